@@ -24,6 +24,7 @@
 
 #include "dnghost.h"
 #include "dngimagewriter.h"
+#include "dngreadimage.h"
 
 #include "dng_camera_profile.h"
 #include "dng_color_space.h"
@@ -56,7 +57,8 @@ int main(int argc, const char* argv [])
                 "Usage: %s [options] <dngfile>\n"
                 "Valid options:\n"
                 "  -o            extract embedded original\n"
-                "  -i            extract ifd images\n",
+                "  -i            extract ifd images\n"
+                "  -s <size>     decode jpeg ifd images at a reduced size of at least <size> pixels\n",
                 argv[0]);
 
         return -1;
@@ -65,6 +67,7 @@ int main(int argc, const char* argv [])
     int32 index;
     bool extractOriginal = false;
     bool extractIfd = false;
+    uint32 extractSize = 0;
     for (index = 1; index < argc && argv[index][0] == '-'; index++)
     {
         std::string option = &argv[index][1];
@@ -78,6 +81,11 @@ int main(int argc, const char* argv [])
         {
             extractIfd = true;
         }
+
+        if (0 == strcmp(option.c_str(), "s"))
+        {
+            extractSize = static_cast<uint32>(atoi(argv[++index]));
+        }
     }
 
     if (index == argc)
@@ -161,7 +169,8 @@ int main(int argc, const char* argv [])
 
             if (true == extractIfd)
             {
-                if ((ifd.fPlanarConfiguration == pcInterleaved) &&
+                if ((extractSize == 0) &&
+                        (ifd.fPlanarConfiguration == pcInterleaved) &&
                         (ifd.fCompression == ccJPEG) &&
                         (ifd.fSamplesPerPixel == 3) &&
                         (ifd.fBitsPerSample[0] == 8) &&
@@ -187,10 +196,7 @@ int main(int argc, const char* argv [])
                 }
                 else
                 {
-                    AutoPtr<dng_image> image;
-
-                    image.Reset(host.Make_dng_image(ifd.Bounds(), ifd.fSamplesPerPixel, ifd.PixelType()));
-                    ifd.ReadImage(host, stream, *image.Get());
+                    AutoPtr<dng_image> image(DngReadImage::ReadScaled(host, ifd, stream, extractSize));
 
                     char outfn[1024];
                     snprintf(outfn, sizeof(outfn), "%s-ifd%#08x.tiff", fileName, ifdIdx);
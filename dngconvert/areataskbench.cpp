@@ -0,0 +1,213 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+// Times DngHost::PerformAreaTask with tiles of uneven cost, once with the
+// area split into one fixed rectangle per thread and once with tiles handed
+// out one at a time. The cost of a tile is slept or, with -b, spun away, so
+// the numbers do not depend on what the tiles compute.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "dng_area_task.h"
+#include "dng_rect.h"
+#include "dng_utils.h"
+
+#include "dnghost.h"
+#include "dngthreadpool.h"
+
+// 64 tiles of 256 x 256
+static const int32 kAreaSize = 2048;
+static const int32 kTileSize = 256;
+
+enum CostProfile
+{
+    costUniform,
+    costHotRow,
+    costHotEdges,
+    costRandom,
+    costProfileCount
+};
+
+static const char* const kProfileNames[costProfileCount] =
+{
+    "uniform",
+    "hot-row",
+    "hot-edges",
+    "random"
+};
+
+class UnevenTask : public dng_area_task
+{
+public:
+    UnevenTask(CostProfile profile, uint32 threads, bool spin) :
+        m_Profile(profile),
+        m_Spin(spin)
+    {
+        fMaxThreads = threads;
+        fMinTaskArea = kTileSize * kTileSize;
+        fMaxTileSize = dng_point(kTileSize, kTileSize);
+    }
+
+    virtual void Process(uint32 threadIndex, const dng_rect& tile, dng_abort_sniffer* sniffer)
+    {
+        (void) threadIndex;
+        (void) sniffer;
+
+        real64 seconds = TileCost(tile.t / kTileSize, tile.l / kTileSize) * 0.001;
+        if (!m_Spin)
+        {
+            usleep(static_cast<useconds_t>(seconds * 1000000.0));
+            return;
+        }
+
+        real64 end = TickTimeInSeconds() + seconds;
+        while (TickTimeInSeconds() < end)
+        {
+        }
+    }
+
+private:
+    // Milliseconds tile (row, col) takes
+    real64 TileCost(int32 row, int32 col) const
+    {
+        const int32 lastTile = kAreaSize / kTileSize - 1;
+
+        switch (m_Profile)
+        {
+        case costHotRow:
+            return row == 0 ? 8.0 : 1.0;
+        case costHotEdges:
+            return (col == 0 || col == lastTile) ? 8.0 : 1.0;
+        case costRandom:
+        {
+            // the same costs on every run
+            uint32 hash = static_cast<uint32>(row * 73856093) ^ static_cast<uint32>(col * 19349663);
+            hash = hash * 2654435761U;
+            return 0.5 + 4.0 * (hash >> 16) / 65535.0;
+        }
+        default:
+            return 1.0;
+        }
+    }
+
+    CostProfile m_Profile;
+    bool m_Spin;
+};
+
+static real64 timeTask(DngHost& host, CostProfile profile, uint32 threads, bool spin)
+{
+    UnevenTask task(profile, threads, spin);
+    dng_rect area(kAreaSize, kAreaSize);
+
+    real64 start = TickTimeInSeconds();
+    host.PerformAreaTask(task, area);
+    return TickTimeInSeconds() - start;
+}
+
+static void benchThreads(uint32 threads, uint32 repeat, bool spin)
+{
+    DngHost::SetThreadCount(threads);
+    DngThreadPool pool(threads - 1);
+    DngHost host(NULL, NULL, &pool);
+
+    printf("%u threads\n", threads);
+    for (int32 profile = 0; profile < costProfileCount; profile++)
+    {
+        real64 staticTime = 0.0;
+        real64 dynamicTime = 0.0;
+        for (uint32 i = 0; i < repeat; i++)
+        {
+            DngHost::SetStaticAreaSplit(true);
+            staticTime += timeTask(host, static_cast<CostProfile>(profile), threads, spin);
+
+            DngHost::SetStaticAreaSplit(false);
+            dynamicTime += timeTask(host, static_cast<CostProfile>(profile), threads, spin);
+        }
+
+        printf("  %-10s static %.1f ms   dynamic %.1f ms   (mean of %u)\n",
+               kProfileNames[profile], staticTime * 1000.0 / repeat, dynamicTime * 1000.0 / repeat, repeat);
+    }
+}
+
+int main(int argc, const char* argv [])
+{
+    std::vector<uint32> threadCounts;
+    uint32 repeat = 5;
+    bool spin = false;
+
+    for (int32 index = 1; index < argc && argv[index][0] == '-'; index++)
+    {
+        std::string option = &argv[index][1];
+
+        if (0 == strcmp(option.c_str(), "h"))
+        {
+            fprintf(stderr,
+                    "\n"
+                    "areataskbench - area task scheduling benchmark\n"
+                    "Usage: %s [options]\n"
+                    "Valid options:\n"
+                    "  -t <n,n,...>  thread counts to time, default 8,16,32\n"
+                    "  -n <count>    run each task <count> times, default 5\n"
+                    "  -b            busy wait instead of sleeping in each tile\n",
+                    argv[0]);
+            return -1;
+        }
+
+        if ((0 == strcmp(option.c_str(), "t")) && (index + 1 < argc))
+        {
+            const char* list = argv[++index];
+            while (*list != '\0')
+            {
+                char* end;
+                long threads = strtol(list, &end, 10);
+                if (end == list)
+                    break;
+                threadCounts.push_back(static_cast<uint32>(Max_int32(1, static_cast<int32>(threads))));
+                list = (*end == ',') ? end + 1 : end;
+            }
+        }
+
+        if ((0 == strcmp(option.c_str(), "n")) && (index + 1 < argc))
+        {
+            repeat = Max_uint32(1, static_cast<uint32>(atoi(argv[++index])));
+        }
+
+        if (0 == strcmp(option.c_str(), "b"))
+        {
+            spin = true;
+        }
+    }
+
+    if (threadCounts.empty())
+    {
+        threadCounts.push_back(8);
+        threadCounts.push_back(16);
+        threadCounts.push_back(32);
+    }
+
+    for (size_t i = 0; i < threadCounts.size(); i++)
+        benchThreads(threadCounts[i], repeat, spin);
+
+    return 0;
+}
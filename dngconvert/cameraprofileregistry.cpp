@@ -0,0 +1,217 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "cameraprofileregistry.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#if qWinOS
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#include "dng_auto_ptr.h"
+#include "dng_exceptions.h"
+#include "dng_file_stream.h"
+#include "dng_tag_values.h"
+
+static std::string cameraKey(const char *camera)
+{
+    std::string key(camera);
+    for (size_t i = 0; i < key.length(); i++)
+        key[i] = static_cast<char>(toupper(static_cast<unsigned char>(key[i])));
+    return key;
+}
+
+static bool isProfileFile(const std::string& name)
+{
+    size_t found = name.find_last_of(".");
+    if (found == std::string::npos || name[0] == '.')
+        return false;
+
+    return cameraKey(name.substr(found + 1).c_str()) == "DCP";
+}
+
+static void listProfiles(const std::string& dir, std::vector<std::string>& files)
+{
+#if qWinOS
+    WIN32_FIND_DATAA findData;
+    HANDLE handle = FindFirstFileA((dir + "\\*.dcp").c_str(), &findData);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isProfileFile(findData.cFileName))
+                files.push_back(dir + "\\" + findData.cFileName);
+        }
+        while (FindNextFileA(handle, &findData));
+        FindClose(handle);
+    }
+#else
+    DIR* dp = opendir(dir.c_str());
+    if (dp != NULL)
+    {
+        struct dirent* entry;
+        while ((entry = readdir(dp)) != NULL)
+        {
+            if (isProfileFile(entry->d_name))
+                files.push_back(dir + "/" + entry->d_name);
+        }
+        closedir(dp);
+    }
+#endif
+
+    std::sort(files.begin(), files.end());
+}
+
+static dng_camera_profile* parseProfile(const char *filename)
+{
+    AutoPtr<dng_camera_profile> profile(new dng_camera_profile);
+    dng_file_stream stream(filename);
+    profile->ParseExtended(stream);
+    return profile.Release();
+}
+
+CameraProfileRegistry::CameraProfileRegistry(const char *directory)
+    : m_Directory(directory != NULL ? directory : ""),
+      m_Mutex("CameraProfileRegistry"),
+      m_Scanned(directory == NULL),
+      m_Files(),
+      m_Cameras(),
+      m_Matrices()
+{
+}
+
+CameraProfileRegistry::~CameraProfileRegistry(void)
+{
+    for (ProfileMap::iterator it = m_Files.begin(); it != m_Files.end(); ++it)
+        delete it->second;
+    for (ProfileMap::iterator it = m_Cameras.begin(); it != m_Cameras.end(); ++it)
+        delete it->second;
+    for (MatrixProfileMap::iterator it = m_Matrices.begin(); it != m_Matrices.end(); ++it)
+        delete it->second.fProfile;
+}
+
+const std::string& CameraProfileRegistry::Directory() const
+{
+    return m_Directory;
+}
+
+dng_camera_profile* CameraProfileRegistry::Copy(const dng_camera_profile *profile)
+{
+    dng_camera_profile *result = new dng_camera_profile(*profile);
+    if (!result)
+    {
+        ThrowMemoryFull();
+    }
+    return result;
+}
+
+dng_camera_profile* CameraProfileRegistry::ProfileFromFile(const char *filename)
+{
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        ProfileMap::const_iterator it = m_Files.find(filename);
+        if (it != m_Files.end())
+            return Copy(it->second);
+    }
+
+    // parsed without the lock, a thread that loses the race to insert
+    // drops its own copy
+    AutoPtr<dng_camera_profile> parsed(parseProfile(filename));
+
+    dng_lock_mutex lock(&m_Mutex);
+    ProfileMap::iterator it = m_Files.find(filename);
+    if (it == m_Files.end())
+        it = m_Files.insert(ProfileMap::value_type(filename, parsed.Release())).first;
+    return Copy(it->second);
+}
+
+void CameraProfileRegistry::ScanDirectory()
+{
+    std::vector<std::string> files;
+    listProfiles(m_Directory, files);
+
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        AutoPtr<dng_camera_profile> profile;
+        try
+        {
+            profile.Reset(parseProfile(files[i].c_str()));
+        }
+        catch (const dng_exception&)
+        {
+            fprintf(stderr, "could not read camera profile %s\n", files[i].c_str());
+            continue;
+        }
+
+        // with several profiles for a camera the first by file name wins
+        const dng_string& camera = profile->UniqueCameraModelRestriction();
+        if (camera.IsEmpty())
+            continue;
+
+        std::string key = cameraKey(camera.Get());
+        if (m_Cameras.find(key) == m_Cameras.end())
+            m_Cameras[key] = profile.Release();
+    }
+}
+
+dng_camera_profile* CameraProfileRegistry::ProfileForCamera(const char *camera)
+{
+    dng_lock_mutex lock(&m_Mutex);
+
+    if (!m_Scanned)
+    {
+        m_Scanned = true;
+        ScanDirectory();
+    }
+
+    ProfileMap::const_iterator it = m_Cameras.find(cameraKey(camera));
+    if (it == m_Cameras.end())
+        return NULL;
+    return Copy(it->second);
+}
+
+dng_camera_profile* CameraProfileRegistry::MatrixProfile(const char *camera, const dng_matrix &colorMatrix)
+{
+    dng_lock_mutex lock(&m_Mutex);
+
+    // some decoders read the matrix from the file, a camera's entry is only
+    // used while the matrix matches
+    MatrixProfileMap::iterator it = m_Matrices.find(camera);
+    if (it != m_Matrices.end() && it->second.fColorMatrix == colorMatrix)
+        return Copy(it->second.fProfile);
+
+    AutoPtr<dng_camera_profile> profile(new dng_camera_profile);
+    profile->SetName(camera);
+    profile->SetColorMatrix1(colorMatrix);
+    profile->SetCalibrationIlluminant1(lsD65);
+
+    if (it == m_Matrices.end())
+    {
+        MatrixProfileEntry entry(colorMatrix, Copy(profile.Get()));
+        m_Matrices.insert(MatrixProfileMap::value_type(camera, entry));
+    }
+
+    return profile.Release();
+}
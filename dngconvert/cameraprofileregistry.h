@@ -0,0 +1,90 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "dng_camera_profile.h"
+#include "dng_matrix.h"
+#include "dng_mutex.h"
+#include "dng_types.h"
+
+// CameraProfileRegistry keeps parsed camera profiles for the whole process
+// so converting many files of the same camera parses each DCP only once.
+// Profiles are found by DCP path, by camera name in an optional directory
+// of DCPs, or built from the raw decoder's color matrix. A dng_negative
+// owns the profiles added to it, so each lookup returns a new copy of the
+// cached profile for the caller to own. All calls are thread safe.
+
+class CameraProfileRegistry
+{
+public:
+    // directory is scanned for *.dcp files on the first ProfileForCamera()
+    // call, NULL disables camera lookups.
+    CameraProfileRegistry(const char *directory = NULL);
+    ~CameraProfileRegistry(void);
+
+    const std::string& Directory() const;
+
+    // Parses filename on first use, throws if it can not be opened.
+    dng_camera_profile* ProfileFromFile(const char *filename);
+
+    // The directory's profile whose unique camera model is camera, compared
+    // case insensitively. Returns NULL if there is none.
+    dng_camera_profile* ProfileForCamera(const char *camera);
+
+    // A profile named camera with colorMatrix as ColorMatrix1 under D65.
+    dng_camera_profile* MatrixProfile(const char *camera, const dng_matrix &colorMatrix);
+
+private:
+    typedef std::map<std::string, dng_camera_profile*> ProfileMap;
+
+    // dng_matrix has no assignment operator, entries are copy constructed
+    struct MatrixProfileEntry
+    {
+        MatrixProfileEntry(const dng_matrix &colorMatrix, dng_camera_profile *profile)
+            : fColorMatrix(colorMatrix),
+              fProfile(profile)
+        {
+        }
+
+        // as given, the profile keeps a normalized copy
+        dng_matrix fColorMatrix;
+        dng_camera_profile *fProfile;
+    };
+    typedef std::map<std::string, MatrixProfileEntry> MatrixProfileMap;
+
+    void ScanDirectory();
+    static dng_camera_profile* Copy(const dng_camera_profile *profile);
+
+private:
+    std::string m_Directory;
+    dng_mutex m_Mutex;
+    bool m_Scanned;
+    ProfileMap m_Files;
+    ProfileMap m_Cameras;
+    MatrixProfileMap m_Matrices;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    CameraProfileRegistry(const CameraProfileRegistry &registry);
+    CameraProfileRegistry& operator=(const CameraProfileRegistry &registry);
+};
@@ -0,0 +1,451 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "convertmanifest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <vector>
+
+#include "config.h"
+
+#include "dng_exceptions.h"
+#include "dng_file_stream.h"
+#include "dng_host.h"
+#include "dng_info.h"
+#include "dng_shared.h"
+
+#include "cameraprofileregistry.h"
+
+// 64 bit MurmurHash2 mixing fed in 8 byte words, fast enough to keep up
+// with reading the raw file
+class ManifestHasher
+{
+public:
+    ManifestHasher()
+        : m_Hash(0x9e3779b97f4a7c15ULL),
+          m_Length(0),
+          m_TailSize(0)
+    {
+    }
+
+    void Add(const void *data, size_t size)
+    {
+        const uint8 *bytes = static_cast<const uint8*>(data);
+        m_Length += size;
+
+        while (size > 0 && m_TailSize > 0)
+        {
+            m_Tail[m_TailSize++] = *bytes++;
+            size--;
+            if (m_TailSize == 8)
+            {
+                AddWord(m_Tail);
+                m_TailSize = 0;
+            }
+        }
+
+        for (; size >= 8; size -= 8, bytes += 8)
+        {
+            AddWord(bytes);
+        }
+
+        while (size > 0)
+        {
+            m_Tail[m_TailSize++] = *bytes++;
+            size--;
+        }
+    }
+
+    std::string Finish()
+    {
+        uint64 hash = m_Hash;
+        if (m_TailSize > 0)
+        {
+            uint64 k = 0;
+            for (uint32 i = 0; i < m_TailSize; i++)
+                k |= static_cast<uint64>(m_Tail[i]) << (8 * i);
+            hash ^= k;
+            hash *= kMultiplier;
+        }
+
+        hash ^= m_Length;
+        hash ^= hash >> 47;
+        hash *= kMultiplier;
+        hash ^= hash >> 47;
+
+        char text[17];
+        sprintf(text, "%08x%08x", static_cast<uint32>(hash >> 32), static_cast<uint32>(hash));
+        return text;
+    }
+
+private:
+    void AddWord(const uint8 *bytes)
+    {
+        uint64 k = 0;
+        for (uint32 i = 0; i < 8; i++)
+            k |= static_cast<uint64>(bytes[i]) << (8 * i);
+
+        k *= kMultiplier;
+        k ^= k >> 47;
+        k *= kMultiplier;
+
+        m_Hash ^= k;
+        m_Hash *= kMultiplier;
+    }
+
+private:
+    static const uint64 kMultiplier = 0xc6a4a7935bd1e995ULL;
+
+    uint64 m_Hash;
+    uint64 m_Length;
+    uint8 m_Tail[8];
+    uint32 m_TailSize;
+};
+
+static bool hashFile(const char *filename, ManifestHasher &hasher)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return false;
+
+    static const size_t kChunkSize = 1024 * 1024;
+    uint8 *chunk = static_cast<uint8*>(malloc(kChunkSize));
+    if (chunk == NULL)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    size_t count;
+    while ((count = fread(chunk, 1, kChunkSize, fp)) > 0)
+    {
+        hasher.Add(chunk, count);
+    }
+
+    bool ok = (ferror(fp) == 0);
+    free(chunk);
+    fclose(fp);
+    return ok;
+}
+
+// Bytes hashed at each end of the input for the quick key
+static const size_t kQuickKeyBytes = 64 * 1024;
+
+// Size, modification time and both ends of the file
+static bool hashFileQuick(const char *filename, ManifestHasher &hasher)
+{
+    struct stat st;
+    if (stat(filename, &st) != 0)
+        return false;
+
+    uint64 stamp[2];
+    stamp[0] = static_cast<uint64>(st.st_size);
+    stamp[1] = static_cast<uint64>(st.st_mtime);
+    hasher.Add(stamp, sizeof(stamp));
+
+    FILE *fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return false;
+
+    uint8 *chunk = static_cast<uint8*>(malloc(kQuickKeyBytes));
+    if (chunk == NULL)
+    {
+        fclose(fp);
+        return false;
+    }
+
+    size_t count = fread(chunk, 1, kQuickKeyBytes, fp);
+    hasher.Add(chunk, count);
+
+    if (stamp[0] > 2 * kQuickKeyBytes)
+    {
+        if (fseek(fp, -static_cast<long>(kQuickKeyBytes), SEEK_END) == 0)
+        {
+            count = fread(chunk, 1, kQuickKeyBytes, fp);
+            hasher.Add(chunk, count);
+        }
+    }
+
+    bool ok = (ferror(fp) == 0);
+    free(chunk);
+    fclose(fp);
+    return ok;
+}
+
+// Quick keys are Finish() output, or empty if the input could not be read
+static bool isQuickKey(const std::string &field)
+{
+    return field.empty() || ((field.length() == 16) &&
+                             (field.find_first_not_of("0123456789abcdef") == std::string::npos));
+}
+
+// Settings that change the output, files given by name count with their
+// contents
+static std::string settingsText(const DngConvertOptions &options)
+{
+    std::string text = std::string("version=") + DNGCONVERT_VERSION_STR;
+
+    const char *files[3] = { options.profilefilename, options.deadpixelfilename, options.exiffilename };
+    const char *names[3] = { "dcp", "dpl", "meta" };
+    for (uint32 i = 0; i < 3; i++)
+    {
+        if (files[i] == NULL)
+            continue;
+
+        text += std::string("\t") + names[i] + "=" + files[i];
+
+        ManifestHasher hasher;
+        if ((strcmp(files[i], "-") != 0) && hashFile(files[i], hasher))
+            text += ":" + hasher.Finish();
+    }
+
+    // the directory's profiles are not hashed, changing them needs a new manifest
+    if ((options.profileRegistry != NULL) && !options.profileRegistry->Directory().empty())
+        text += "\tdcpdir=" + options.profileRegistry->Directory();
+
+    if (options.embedOriginal)
+        text += "\te=1";
+    if (options.fastPreview)
+        text += "\tfastpreview=1";
+    if (options.cameraPreview)
+        text += "\tcamerapreview=1";
+    for (size_t i = 0; i < options.previewSizes.size(); i++)
+    {
+        char size[32];
+        sprintf(size, "\tpreview=%u", options.previewSizes[i]);
+        text += size;
+    }
+
+    return text;
+}
+
+// Size and RawImageDigest of a DNG, read from its IFDs only
+static bool readDigest(const std::string &filename, uint64 &size, std::string &digest)
+{
+    try
+    {
+        dng_file_stream stream(filename.c_str());
+        size = stream.Length();
+
+        dng_host host;
+        dng_info info;
+        info.Parse(host, stream);
+        info.PostParse(host);
+
+        if (!info.IsValidDNG() || info.fShared->fRawImageDigest.IsNull())
+            return false;
+
+        digest.clear();
+        for (uint32 i = 0; i < 16; i++)
+        {
+            char hex[3];
+            sprintf(hex, "%02x", info.fShared->fRawImageDigest.data[i]);
+            digest += hex;
+        }
+
+        return true;
+    }
+    catch (...)
+    {
+        return false;
+    }
+}
+
+ConvertManifest::ConvertManifest(const char *path, const DngConvertOptions &options)
+    : m_Path(path),
+      m_Settings(settingsText(options)),
+      m_Mutex("ConvertManifest"),
+      m_Entries()
+{
+}
+
+ConvertManifest::~ConvertManifest(void)
+{
+}
+
+bool ConvertManifest::Load()
+{
+    FILE *fp = fopen(m_Path.c_str(), "r");
+    if (fp == NULL)
+        return true;
+
+    dng_lock_mutex lock(&m_Mutex);
+
+    std::string line;
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), fp) != NULL)
+    {
+        line += buffer;
+        if (line[line.length() - 1] != '\n' && !feof(fp))
+            continue;
+
+        while (!line.empty() && (line[line.length() - 1] == '\n' || line[line.length() - 1] == '\r'))
+            line.erase(line.length() - 1);
+
+        // later lines replace earlier ones for the same output
+        std::vector<std::string> fields;
+        size_t start = 0;
+        while (fields.size() < 4)
+        {
+            size_t tab = line.find('\t', start);
+            if (tab == std::string::npos)
+                break;
+            fields.push_back(line.substr(start, tab - start));
+            start = tab + 1;
+        }
+        fields.push_back(line.substr(start));
+
+        if (!line.empty() && line[0] != '#' && fields.size() >= 4)
+        {
+            // older manifests have no quick key, their output path is the
+            // fourth field and may itself contain tabs
+            if ((fields.size() == 5) && !isQuickKey(fields[3]))
+            {
+                fields[3] += "\t" + fields[4];
+                fields.pop_back();
+            }
+            if (fields.size() == 4)
+                fields.insert(fields.begin() + 3, std::string());
+
+            Entry entry;
+            entry.fKey = fields[0];
+            entry.fSize = strtoull(fields[1].c_str(), NULL, 10);
+            entry.fDigest = fields[2];
+            entry.fQuickKey = fields[3];
+            m_Entries[fields[4]] = entry;
+        }
+
+        line.clear();
+    }
+
+    bool ok = (ferror(fp) == 0);
+    fclose(fp);
+    return ok;
+}
+
+bool ConvertManifest::Save()
+{
+    dng_lock_mutex lock(&m_Mutex);
+
+    // written next to the old file and renamed, a crash leaves one of both
+    std::string temp = m_Path + ".tmp";
+    FILE *fp = fopen(temp.c_str(), "w");
+    if (fp == NULL)
+        return false;
+
+    fprintf(fp, "# dngconvert manifest: key, size, raw image digest, quick key, output\n");
+    for (std::map<std::string, Entry>::const_iterator it = m_Entries.begin(); it != m_Entries.end(); ++it)
+    {
+        fprintf(fp, "%s\t%llu\t%s\t%s\t%s\n", it->second.fKey.c_str(),
+                static_cast<unsigned long long>(it->second.fSize),
+                it->second.fDigest.c_str(), it->second.fQuickKey.c_str(), it->first.c_str());
+    }
+
+    bool ok = (fclose(fp) == 0);
+#if qWinOS
+    remove(m_Path.c_str());
+#endif
+    if (!ok || (rename(temp.c_str(), m_Path.c_str()) != 0))
+    {
+        remove(temp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+std::string ConvertManifest::Key(const std::string &input)
+{
+    ManifestHasher hasher;
+    hasher.Add(m_Settings.c_str(), m_Settings.length() + 1);
+    if (!hashFile(input.c_str(), hasher))
+        return std::string();
+
+    return hasher.Finish();
+}
+
+std::string ConvertManifest::Key(const void *data, uint32 size)
+{
+    ManifestHasher hasher;
+    hasher.Add(m_Settings.c_str(), m_Settings.length() + 1);
+    hasher.Add(data, size);
+
+    return hasher.Finish();
+}
+
+std::string ConvertManifest::QuickKey(const std::string &input)
+{
+    ManifestHasher hasher;
+    hasher.Add(m_Settings.c_str(), m_Settings.length() + 1);
+    if (!hashFileQuick(input.c_str(), hasher))
+        return std::string();
+
+    return hasher.Finish();
+}
+
+bool ConvertManifest::MayBeCurrent(const std::string &quickKey, const std::string &output)
+{
+    if (quickKey.empty())
+        return false;
+
+    dng_lock_mutex lock(&m_Mutex);
+    std::map<std::string, Entry>::const_iterator it = m_Entries.find(output);
+    return (it != m_Entries.end()) && (it->second.fQuickKey == quickKey);
+}
+
+bool ConvertManifest::IsCurrent(const std::string &key, const std::string &output)
+{
+    Entry entry;
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        std::map<std::string, Entry>::const_iterator it = m_Entries.find(output);
+        if (it == m_Entries.end() || it->second.fKey != key)
+            return false;
+        entry = it->second;
+    }
+
+    uint64 size = 0;
+    std::string digest;
+    return readDigest(output, size, digest) && (size == entry.fSize) && (digest == entry.fDigest);
+}
+
+void ConvertManifest::Record(const std::string &key, const std::string &quickKey, const std::string &output)
+{
+    Entry entry;
+    entry.fKey = key;
+    entry.fQuickKey = quickKey;
+    if (!readDigest(output, entry.fSize, entry.fDigest))
+        return;
+
+    dng_lock_mutex lock(&m_Mutex);
+    m_Entries[output] = entry;
+
+    FILE *fp = fopen(m_Path.c_str(), "a");
+    if (fp != NULL)
+    {
+        fprintf(fp, "%s\t%llu\t%s\t%s\t%s\n", entry.fKey.c_str(),
+                static_cast<unsigned long long>(entry.fSize),
+                entry.fDigest.c_str(), entry.fQuickKey.c_str(), output.c_str());
+        fclose(fp);
+    }
+}
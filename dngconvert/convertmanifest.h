@@ -0,0 +1,88 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "dng_mutex.h"
+#include "dng_types.h"
+
+#include "dngconverter.h"
+
+// On disk record of finished conversions for incremental batch runs. Each
+// output is stored with a key hashed from the input file's contents and
+// all conversion settings, plus its size and RawImageDigest. A later run
+// with the same key can skip the file as long as the output still has that
+// size and digest, which is read from the DNG's IFDs without decoding it.
+//
+// A quick key from the input's size, modification time and first and last
+// 64 KB is stored too. Only inputs whose quick key matches are hashed in
+// full to confirm the skip, all others are keyed from the data the
+// conversion reads anyway.
+//
+// One tab separated line per output: key, size, digest, quick key, output
+// path. Lines without the quick key from older manifests are read as well.
+
+class ConvertManifest
+{
+public:
+    ConvertManifest(const char *path, const DngConvertOptions &options);
+    ~ConvertManifest(void);
+
+    // A missing manifest file is an empty manifest.
+    bool Load();
+    // Rewrites the file with one line per output.
+    bool Save();
+
+    // Empty if the input could not be read.
+    std::string Key(const std::string &input);
+    std::string Key(const void *data, uint32 size);
+    std::string QuickKey(const std::string &input);
+
+    // True if output was recorded with quickKey, the full key must still
+    // be checked with IsCurrent().
+    bool MayBeCurrent(const std::string &quickKey, const std::string &output);
+
+    bool IsCurrent(const std::string &key, const std::string &output);
+
+    // Appends the entry to the file at once, an interrupted batch keeps
+    // the files finished so far.
+    void Record(const std::string &key, const std::string &quickKey, const std::string &output);
+
+private:
+    struct Entry
+    {
+        std::string fKey;
+        std::string fQuickKey;
+        uint64 fSize;
+        std::string fDigest;
+    };
+
+    std::string m_Path;
+    std::string m_Settings;
+    dng_mutex m_Mutex;
+    std::map<std::string, Entry> m_Entries;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    ConvertManifest(const ConvertManifest &manifest);
+    ConvertManifest& operator=(const ConvertManifest &manifest);
+};
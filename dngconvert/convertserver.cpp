@@ -0,0 +1,489 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "convertserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if !qWinOS
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#endif
+
+#include "dng_exceptions.h"
+#include "dng_mutex.h"
+#include "dng_utils.h"
+
+#if !qWinOS
+
+// A parsed request, owns the strings DngConvertOptions points to
+struct ConvertRequest
+{
+    std::string input;
+    std::string output;
+    std::string profile;
+    std::string deadpixels;
+    std::string meta;
+    DngConvertOptions options;
+};
+
+static std::string formatRequest(const std::string& input, const std::string& output, const DngConvertOptions& options)
+{
+    std::string line = "in=" + input + "\tout=" + output;
+
+    if (options.profilefilename != NULL)
+        line += std::string("\tdcp=") + options.profilefilename;
+    if (options.deadpixelfilename != NULL)
+        line += std::string("\tdpl=") + options.deadpixelfilename;
+    if (options.exiffilename != NULL)
+        line += std::string("\tmeta=") + options.exiffilename;
+    if (options.embedOriginal)
+        line += "\te=1";
+    if (options.fastPreview)
+        line += "\tfastpreview=1";
+    if (options.cameraPreview)
+        line += "\tcamerapreview=1";
+    for (size_t i = 0; i < options.previewSizes.size(); i++)
+    {
+        char size[16];
+        sprintf(size, "%u", options.previewSizes[i]);
+        line += std::string("\tpreview=") + size;
+    }
+
+    return line + "\n";
+}
+
+static bool parseRequest(const std::string& line, ConvertRequest& request)
+{
+    size_t start = 0;
+    while (start <= line.length())
+    {
+        size_t end = line.find('\t', start);
+        if (end == std::string::npos)
+            end = line.length();
+
+        std::string field = line.substr(start, end - start);
+        start = end + 1;
+
+        if (field.empty())
+            continue;
+
+        size_t equals = field.find('=');
+        if (equals == std::string::npos)
+            return false;
+
+        std::string key = field.substr(0, equals);
+        std::string value = field.substr(equals + 1);
+
+        if (key == "in")
+            request.input = value;
+        else if (key == "out")
+            request.output = value;
+        else if (key == "dcp")
+            request.profile = value;
+        else if (key == "dpl")
+            request.deadpixels = value;
+        else if (key == "meta")
+            request.meta = value;
+        else if (key == "e")
+            request.options.embedOriginal = (value == "1");
+        else if (key == "fastpreview")
+            request.options.fastPreview = (value == "1");
+        else if (key == "camerapreview")
+            request.options.cameraPreview = (value == "1");
+        else if (key == "preview")
+            request.options.previewSizes.push_back(static_cast<uint32>(atoi(value.c_str())));
+        else
+            return false;
+    }
+
+    if (!request.profile.empty())
+        request.options.profilefilename = request.profile.c_str();
+    if (!request.deadpixels.empty())
+        request.options.deadpixelfilename = request.deadpixels.c_str();
+    if (!request.meta.empty())
+        request.options.exiffilename = request.meta.c_str();
+
+    return !request.input.empty() && !request.output.empty();
+}
+
+// Runs one request on the server's pool, the connection thread waits for
+// it before answering
+class RequestJob : public DngThreadPool::Job
+{
+public:
+    RequestJob(const ConvertRequest& request, dng_memory_allocator& allocator)
+        : m_Request(request),
+          m_Allocator(allocator),
+          m_Mutex("RequestJob"),
+          m_Finished(),
+          m_Done(false),
+          m_Ok(false),
+          m_Seconds(0.0)
+    {
+    }
+
+    virtual void Run()
+    {
+        real64 start = TickTimeInSeconds();
+        bool ok = false;
+
+        try
+        {
+            DngConverter converter(m_Request.options, m_Allocator);
+            ok = converter.Convert(m_Request.input.c_str(), m_Request.output.c_str());
+        }
+        catch (const dng_exception& except)
+        {
+            fprintf(stderr, "%s: conversion failed with dng error %d\n", m_Request.input.c_str(), static_cast<int>(except.ErrorCode()));
+        }
+        catch (...)
+        {
+            fprintf(stderr, "%s: conversion failed with unknown error\n", m_Request.input.c_str());
+        }
+
+        dng_lock_mutex lock(&m_Mutex);
+        m_Ok = ok;
+        m_Seconds = TickTimeInSeconds() - start;
+        m_Done = true;
+        m_Finished.Broadcast();
+    }
+
+    void WaitDone()
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        while (!m_Done)
+        {
+            m_Finished.Wait(m_Mutex);
+        }
+    }
+
+    bool Ok() const { return m_Ok; }
+    real64 Seconds() const { return m_Seconds; }
+
+private:
+    ConvertRequest m_Request;
+    dng_memory_allocator& m_Allocator;
+    dng_mutex m_Mutex;
+    dng_condition m_Finished;
+    bool m_Done;
+    bool m_Ok;
+    real64 m_Seconds;
+};
+
+// Longest request line read from a client
+static const size_t kMaxRequestLine = 64 * 1024;
+
+enum ReadLineResult
+{
+    readLineDone = 0,
+    readLineOk,
+    readLineTooLong
+};
+
+static ReadLineResult readLine(FILE* in, std::string& line)
+{
+    char buffer[1024];
+
+    line.clear();
+    while (fgets(buffer, sizeof(buffer), in) != NULL)
+    {
+        line += buffer;
+        if (line[line.length() - 1] == '\n')
+        {
+            line.erase(line.length() - 1);
+            return readLineOk;
+        }
+        if (line.length() > kMaxRequestLine)
+            return readLineTooLong;
+    }
+
+    return line.empty() ? readLineDone : readLineOk;
+}
+
+static bool writeAll(int fd, const std::string& data)
+{
+    size_t written = 0;
+    while (written < data.length())
+    {
+        ssize_t count = write(fd, data.c_str() + written, data.length() - written);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        written += static_cast<size_t>(count);
+    }
+    return true;
+}
+
+static bool makeAddress(const std::string& path, sockaddr_un& address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(address.sun_path))
+        return false;
+    strcpy(address.sun_path, path.c_str());
+    return true;
+}
+
+static std::string absolutePath(const std::string& path)
+{
+    if (path.empty() || (path[0] == '/') || (path == "-"))
+        return path;
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return path;
+
+    return std::string(cwd) + "/" + path;
+}
+
+#endif
+
+// Clients served at once, one handler thread each
+static const uint32 kMaxConnections = 64;
+
+// Serves one client on a handler thread and deletes itself when the
+// client is done
+class ConvertServer::ConnectionJob : public DngThreadPool::Job
+{
+public:
+    ConnectionJob(ConvertServer* server, int fd)
+        : m_Server(server),
+          m_Fd(fd)
+    {
+    }
+
+    virtual void Run()
+    {
+        m_Server->HandleConnection(m_Fd);
+        delete this;
+    }
+
+private:
+    ConvertServer* m_Server;
+    int m_Fd;
+};
+
+ConvertServer::ConvertServer(const char *socketPath, uint32 threads, uint32 maxQueued,
+                             CameraProfileRegistry *profileRegistry,
+                             dng_memory_allocator &allocator)
+    : m_SocketPath(socketPath),
+      m_Pool(threads, maxQueued),
+      m_ProfileRegistry(profileRegistry),
+      m_Allocator(allocator),
+      m_Handlers(kMaxConnections, 1)
+{
+}
+
+ConvertServer::~ConvertServer(void)
+{
+}
+
+int ConvertServer::Run()
+{
+#if qWinOS
+    fprintf(stderr, "-serve is not supported on this platform\n");
+    return 1;
+#else
+    sockaddr_un address;
+    if (!makeAddress(m_SocketPath, address))
+    {
+        fprintf(stderr, "socket path %s is too long\n", m_SocketPath.c_str());
+        return 1;
+    }
+
+    int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0)
+    {
+        fprintf(stderr, "could not create socket\n");
+        return 1;
+    }
+
+    // a socket file left behind by an earlier server blocks bind(), any
+    // other file at the path is left alone and bind() fails
+    struct stat st;
+    if ((lstat(m_SocketPath.c_str(), &st) == 0) && S_ISSOCK(st.st_mode))
+        unlink(m_SocketPath.c_str());
+
+    if ((bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0) || (listen(listenFd, 16) != 0))
+    {
+        fprintf(stderr, "could not listen on %s\n", m_SocketPath.c_str());
+        close(listenFd);
+        return 1;
+    }
+
+    // a client going away while we answer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("serving on %s with %u threads\n", m_SocketPath.c_str(), Max_uint32(1, m_Pool.Threads()));
+    fflush(stdout);
+
+    while (true)
+    {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        // blocks while all handlers are busy and one client is queued
+        m_Handlers.Submit(new ConnectionJob(this, fd));
+    }
+
+    close(listenFd);
+    unlink(m_SocketPath.c_str());
+    return 1;
+#endif
+}
+
+void ConvertServer::HandleConnection(int fd)
+{
+#if !qWinOS
+    FILE* in = fdopen(dup(fd), "r");
+    if (in == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    std::string line;
+    ReadLineResult result;
+    while ((result = readLine(in, line)) != readLineDone)
+    {
+        // a client that never ends its line is not read from any further
+        if (result == readLineTooLong)
+        {
+            writeAll(fd, "ERROR request too long\n");
+            break;
+        }
+
+        if (line.empty())
+            continue;
+
+        ConvertRequest request;
+        std::string reply;
+
+        if (!parseRequest(line, request))
+        {
+            reply = "ERROR malformed request\n";
+        }
+        else
+        {
+            request.options.profileRegistry = m_ProfileRegistry;
+
+            // Submit blocks while the pool's queue is full, the client
+            // then waits for its reply and no further requests are read
+            RequestJob job(request, m_Allocator);
+            m_Pool.Submit(&job);
+            job.WaitDone();
+
+            char buffer[64];
+            sprintf(buffer, "%s %.3f\n", job.Ok() ? "OK" : "FAILED", job.Seconds());
+            reply = buffer;
+        }
+
+        if (!writeAll(fd, reply))
+            break;
+    }
+
+    fclose(in);
+    close(fd);
+#else
+    (void)fd;
+#endif
+}
+
+ConvertClient::ConvertClient(const char *socketPath)
+    : m_SocketPath(socketPath)
+{
+}
+
+bool ConvertClient::Convert(const std::string &input, const std::string &output,
+                            const DngConvertOptions &options, std::string &reply)
+{
+#if qWinOS
+    (void)input;
+    (void)output;
+    (void)options;
+    (void)reply;
+    return false;
+#else
+    sockaddr_un address;
+    if (!makeAddress(m_SocketPath, address))
+        return false;
+
+    // the server resolves paths in its own working directory
+    std::string profile, deadpixels, meta;
+    DngConvertOptions remote(options);
+    if (options.profilefilename != NULL)
+    {
+        profile = absolutePath(options.profilefilename);
+        remote.profilefilename = profile.c_str();
+    }
+    if (options.deadpixelfilename != NULL)
+    {
+        deadpixels = absolutePath(options.deadpixelfilename);
+        remote.deadpixelfilename = deadpixels.c_str();
+    }
+    if (options.exiffilename != NULL)
+    {
+        meta = absolutePath(options.exiffilename);
+        remote.exiffilename = meta.c_str();
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return false;
+
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    bool ok = writeAll(fd, formatRequest(absolutePath(input), absolutePath(output), remote));
+
+    FILE* in = ok ? fdopen(fd, "r") : NULL;
+    if (in != NULL)
+    {
+        ok = readLine(in, reply);
+        fclose(in);
+    }
+    else
+    {
+        ok = false;
+        close(fd);
+    }
+
+    return ok;
+#endif
+}
@@ -0,0 +1,93 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <string>
+
+#include "dng_types.h"
+
+#include "dngconverter.h"
+#include "dngthreadpool.h"
+
+// Conversion service on a local UNIX domain socket. A client sends one
+// request per line as tab separated key=value fields:
+//
+//   in=<rawfile> out=<dngfile> [dcp=<file>] [dpl=<file>] [meta=<file>|-]
+//   [e=1] [fastpreview=1] [camerapreview=1] [preview=<size>]...
+//
+// and gets one line back per request, "OK <seconds>", "FAILED <seconds>"
+// or "ERROR <message>" for a malformed request. Lines longer than 64 KB
+// get "ERROR request too long" and the connection is closed. Paths are
+// used as given, so clients should send absolute ones.
+//
+// At most 64 clients are served at once, each by one of a fixed
+// set of handler threads. Further clients wait in the listen backlog
+// until one of them disconnects.
+
+class ConvertServer
+{
+public:
+    // threads conversions run at once, at most maxQueued more wait for a
+    // thread. Clients beyond that are not read from until a slot frees up.
+    // Requests share profileRegistry's profiles if it is not NULL and
+    // take their memory from allocator.
+    ConvertServer(const char *socketPath, uint32 threads, uint32 maxQueued,
+                  CameraProfileRegistry *profileRegistry = NULL,
+                  dng_memory_allocator &allocator = gDefaultDNGMemoryAllocator);
+    ~ConvertServer(void);
+
+    // Accepts clients until the process is terminated. Returns non zero
+    // if the socket could not be set up.
+    int Run();
+
+private:
+    class ConnectionJob;
+    friend class ConnectionJob;
+
+    void HandleConnection(int fd);
+
+private:
+    std::string m_SocketPath;
+    DngThreadPool m_Pool;
+    CameraProfileRegistry *m_ProfileRegistry;
+    dng_memory_allocator &m_Allocator;
+    // destroyed first, open connections finish before m_Pool goes away
+    DngThreadPool m_Handlers;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    ConvertServer(const ConvertServer &server);
+    ConvertServer& operator=(const ConvertServer &server);
+};
+
+class ConvertClient
+{
+public:
+    ConvertClient(const char *socketPath);
+
+    // Sends one request on a new connection and waits for the reply.
+    // Relative paths are made absolute first. Returns false if the server
+    // could not be reached, reply holds the server's answer otherwise.
+    bool Convert(const std::string &input, const std::string &output,
+                 const DngConvertOptions &options, std::string &reply);
+
+private:
+    std::string m_SocketPath;
+};
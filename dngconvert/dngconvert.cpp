@@ -23,518 +23,958 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
-#include <assert.h>
+#include <vector>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
 
-#include "config.h"
+#if qWinOS
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
 
-#include "dng_bad_pixels.h"
-#include "dng_camera_profile.h"
-#include "dng_color_space.h"
 #include "dng_exceptions.h"
-#include "dng_file_stream.h"
-#include "dng_globals.h"
-#include "dng_host.h"
-#include "dng_ifd.h"
-#include "dng_image_writer.h"
-#include "dng_info.h"
-#include "dng_linearization_info.h"
-#include "dng_memory_stream.h"
-#include "dng_mosaic_info.h"
-#include "dng_negative.h"
-#include "dng_preview.h"
-#include "dng_read_image.h"
-#include "dng_render.h"
-#include "dng_simple_image.h"
-#include "dng_tag_codes.h"
-#include "dng_tag_types.h"
-#include "dng_tag_values.h"
-#include "dng_xmp.h"
+#include "dng_utils.h"
 #include "dng_xmp_sdk.h"
 
-#include "zlib.h"
-#define CHUNK 65536
+#include "cameraprofileregistry.h"
+#include "convertmanifest.h"
+#include "convertserver.h"
+#include "dngconverter.h"
+#include "dnghost.h"
+#include "dngpoolallocator.h"
+#include "dngprofile.h"
+#include "dngthreadpool.h"
+#include "memorybudget.h"
 
-#include "exiv2meta.h"
-#include "librawimage.h"
+// output filename: replace raw file extension with .dng, optionally placed in outdir
+static std::string outputFilename(const std::string& filename, const char* outdir)
+{
+    std::string result(filename);
 
-#include "dnghost.h"
-#include "dngimagewriter.h"
+    if (outdir != NULL)
+    {
+        size_t found = result.find_last_of("\\/");
+        if (found != std::string::npos)
+            result = result.substr(found + 1);
+        std::string dir(outdir);
+        if (!dir.empty() && (dir[dir.length() - 1] != '/') && (dir[dir.length() - 1] != '\\'))
+            dir.append("/");
+        result = dir + result;
+    }
 
-using std::min;
-using std::max;
+    size_t found = result.find_last_of(".");
+    if (found != std::string::npos && found > result.find_last_of("\\/") + 1)
+        result.resize(found);
+    result.append(".dng");
 
-const char* version() { return DNGCONVERT_VERSION_STR; }
+    return result;
+}
 
-int main(int argc, const char* argv [])
-{  
-    if(argc == 1)
-    {
-        fprintf(stderr,
-                "\n"
-                "dngconvert - DNG convertion tool\n"
-                "Usage: %s [options] <dngfile>\n"
-                "Valid options:\n"
-                "  -dcp <filename>      use adobe camera profile\n"
-                "  -dpl <filename>      include dead pixel list\n"
-                "  -e                   embed original\n"
-                "  -meta <filename>|-   read exif/xmp from this file, - to disable\n"
-                "  -o <filename>        specify output filename\n",
-                argv[0]);
+static bool isDirectory(const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return false;
+    return (st.st_mode & S_IFMT) == S_IFDIR;
+}
 
-        return -1;
-    }
+static uint64 fileSize(const char* path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    return static_cast<uint64>(st.st_size);
+}
 
-    //parse options
-    int index;
-    const char* deadpixelfilename = NULL;
-    const char* outfilename = NULL;
-    const char* profilefilename = NULL;
-    const char* exiffilename = NULL;
-    bool embedOriginal = false;
+// directory inputs skip hidden files and DNGs, which are usually our own output
+static bool isConvertibleEntry(const std::string& name)
+{
+    if (name.empty() || name[0] == '.')
+        return false;
 
-    for (index = 1; index < argc && argv [index][0] == '-'; index++)
+    size_t found = name.find_last_of(".");
+    if (found != std::string::npos)
     {
-        std::string option = &argv[index][1];
+        std::string ext = name.substr(found + 1);
+        for (size_t i = 0; i < ext.length(); i++)
+            ext[i] = static_cast<char>(tolower(ext[i]));
+        if (ext == "dng" || ext == "xmp")
+            return false;
+    }
 
-        if (0 == strcmp(option.c_str(), "o"))
+    return true;
+}
+
+static void listDirectory(const std::string& dir, std::vector<std::string>& inputs)
+{
+    std::vector<std::string> entries;
+
+#if qWinOS
+    WIN32_FIND_DATAA findData;
+    HANDLE handle = FindFirstFileA((dir + "\\*").c_str(), &findData);
+    if (handle != INVALID_HANDLE_VALUE)
+    {
+        do
         {
-            outfilename = argv[++index];
+            if (!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && isConvertibleEntry(findData.cFileName))
+                entries.push_back(dir + "\\" + findData.cFileName);
         }
-
-        if (0 == strcmp(option.c_str(), "dpl"))
+        while (FindNextFileA(handle, &findData));
+        FindClose(handle);
+    }
+#else
+    DIR* dp = opendir(dir.c_str());
+    if (dp != NULL)
+    {
+        struct dirent* entry;
+        while ((entry = readdir(dp)) != NULL)
         {
-            deadpixelfilename = argv[++index];
+            std::string path = dir + "/" + entry->d_name;
+            if (isConvertibleEntry(entry->d_name) && !isDirectory(path.c_str()))
+                entries.push_back(path);
         }
+        closedir(dp);
+    }
+#endif
 
-        if (0 == strcmp(option.c_str(), "dcp"))
+    std::sort(entries.begin(), entries.end());
+    inputs.insert(inputs.end(), entries.begin(), entries.end());
+}
+
+// expands @listfile and directory arguments, returns false if arg could not be read
+static bool collectInputs(const char* arg, std::vector<std::string>& inputs)
+{
+    if (arg[0] == '@')
+    {
+        FILE *fp = fopen(arg + 1, "r");
+        if (!fp)
+            return false;
+
+        char line[4096];
+        while (fgets(line, sizeof(line), fp))
         {
-            profilefilename = argv[++index];
+            size_t len = strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+                line[--len] = 0;
+            if (len > 0 && line[0] != '#')
+                inputs.push_back(line);
         }
+        fclose(fp);
+        return true;
+    }
 
-        if (0 == strcmp(option.c_str(), "e"))
+    if (isDirectory(arg))
+    {
+        listDirectory(arg, inputs);
+        return true;
+    }
+
+    inputs.push_back(arg);
+    return true;
+}
+
+// Phases of a conversion, in pipelined batch mode each one runs on its own
+// thread pool with a bounded queue in front of it
+enum ConvertStage
+{
+    stageRead = 0,
+    stageDecode,
+    stageRender,
+    stageWrite,
+    stageCount
+};
+
+enum ProfileFormat
+{
+    profileNone = 0,
+    profileText,
+    profileJSON
+};
+
+class ConvertJob : public DngThreadPool::Job
+{
+public:
+    ConvertJob(const std::string& filename, const std::string& outfilename, const DngConvertOptions& options, bool verbose,
+               dng_memory_allocator& allocator)
+        : m_Filename(filename),
+          m_OutFilename(outfilename),
+          m_Options(options),
+          m_Allocator(allocator),
+          m_Verbose(verbose),
+          m_Result(-1),
+          m_Start(0.0),
+          m_Seconds(0.0),
+          m_Bytes(0),
+          m_Converter(),
+          m_Pools(NULL),
+          m_ProfileFormat(profileNone),
+          m_Tracker(allocator),
+          m_Profile(&m_Tracker),
+          m_CPUStart(0.0),
+          m_Manifest(NULL),
+          m_Key(),
+          m_QuickKey(),
+          m_Skipped(false),
+          m_Prepared(false),
+          m_Budget(NULL),
+          m_BudgetBytes(0)
+    {
+        for (uint32 stage = 0; stage < stageCount; stage++)
         {
-            embedOriginal = true;
+            m_StageJobs[stage].m_Owner = this;
+            m_StageJobs[stage].m_Stage = stage;
         }
-        
-        if (0 == strcmp(option.c_str(), "meta"))
+    }
+
+    // Runs all phases back to back on the calling thread
+    virtual void Run()
+    {
+        for (uint32 stage = 0; stage < stageCount; stage++)
         {
-            exiffilename = argv[++index];
+            if (!RunStage(stage))
+                break;
         }
     }
 
-    if (index == argc)
+    // Lets each phase run on pools[stage], the job passes itself on to the
+    // next pool when a phase succeeded. Submit FirstStage() to pools[0].
+    void SetPipeline(DngThreadPool** pools)
     {
-        fprintf (stderr, "no file specified\n");
-        return 1;
+        m_Pools = pools;
     }
 
-    const char* filename = argv[index++];
+    DngThreadPool::Job* FirstStage()
+    {
+        return &m_StageJobs[stageRead];
+    }
 
-    dng_xmp_sdk::InitializeSDK();
+    // Prints the time and memory spent in each phase once the file is done
+    void SetProfileFormat(ProfileFormat format)
+    {
+        m_ProfileFormat = format;
+    }
 
-    dng_memory_allocator memalloc(gDefaultDNGMemoryAllocator);
+    // Skips files the manifest has an up to date output for and records
+    // the ones converted
+    void SetManifest(ConvertManifest* manifest)
+    {
+        m_Manifest = manifest;
+    }
 
-    DngHost host(&memalloc);
+    // The job's reservation in budget, given back once the converter is
+    // freed. Its size is estimated by Prepare().
+    void SetBudget(MemoryBudget* budget)
+    {
+        m_Budget = budget;
+    }
 
-    host.SetSaveDNGVersion(dngVersion_SaveDefault);
-    host.SetSaveLinearDNG(false);
-    host.SetKeepOriginalFile(true);
+    // Checks the manifest and, with estimate set, the peak memory of the
+    // conversion. Runs once, either before the job is admitted or when its
+    // first phase starts. Files the manifest skips reserve nothing.
+    void Prepare(bool estimate)
+    {
+        if (m_Prepared)
+            return;
+        m_Prepared = true;
+
+        try
+        {
+            if (m_Manifest != NULL)
+            {
+                // only outputs recorded with the same quick key can be
+                // current, the others are keyed from the buffer the
+                // conversion reads
+                m_QuickKey = m_Manifest->QuickKey(m_Filename);
+                if (m_Manifest->MayBeCurrent(m_QuickKey, m_OutFilename))
+                {
+                    m_Key = m_Manifest->Key(m_Filename);
+                    m_Skipped = !m_Key.empty() && m_Manifest->IsCurrent(m_Key, m_OutFilename);
+                }
+            }
 
-    AutoPtr<dng_image> image(new LibRawImage(filename, memalloc));
-    LibRawImage* rawImage = static_cast<LibRawImage*>(image.Get());
+            if (estimate && !m_Skipped)
+                m_BudgetBytes = DngConverter::EstimatePeakBytes(m_Filename.c_str(), m_Options);
+        }
+        catch (...)
+        {
+            // the read phase reports the error
+        }
+    }
 
-    // -----------------------------------------------------------------------------------------
+    uint64 BudgetBytes() const { return m_BudgetBytes; }
 
-    AutoPtr<dng_negative> negative(host.Make_dng_negative());
+    int Result() const { return m_Result; }
+    bool Skipped() const { return m_Skipped; }
+    real64 Seconds() const { return m_Seconds; }
+    uint64 Bytes() const { return m_Bytes; }
 
-    negative->SetDefaultScale(rawImage->DefaultScaleH(), rawImage->DefaultScaleV());
-    negative->SetDefaultCropOrigin(rawImage->DefaultCropOriginH(), rawImage->DefaultCropOriginV());
-    negative->SetDefaultCropSize(rawImage->DefaultCropSizeH(), rawImage->DefaultCropSizeV());
-    negative->SetActiveArea(rawImage->ActiveArea());
+private:
+    class StageJob : public DngThreadPool::Job
+    {
+    public:
+        StageJob() : m_Owner(NULL), m_Stage(0) {}
 
-    std::string file(filename);
-    size_t found = min(file.rfind("\\"), file.rfind("/"));
-    if (found != std::string::npos)
-        file = file.substr(found + 1, file.length() - found - 1);
-    negative->SetOriginalRawFileName(file.c_str());
+        virtual void Run()
+        {
+            if (m_Owner->RunStage(m_Stage) && (m_Stage + 1 < stageCount))
+                m_Owner->m_Pools[m_Stage + 1]->Submit(&m_Owner->m_StageJobs[m_Stage + 1]);
+        }
 
-    negative->SetColorChannels(rawImage->Channels());
-    negative->SetColorKeys(rawImage->ColorKey(0), rawImage->ColorKey(1), rawImage->ColorKey(2), rawImage->ColorKey(3));
+        ConvertJob* m_Owner;
+        uint32 m_Stage;
+    };
 
-    uint32 bayerPhase = 0xFFFFFFFF;
-    if (rawImage->Channels() == 4)
+    // Returns false when the conversion failed and the remaining phases
+    // must be skipped
+    bool RunStage(uint32 stage)
     {
-        negative->SetQuadMosaic(rawImage->Pattern());
+        bool ok = false;
+
+        try
+        {
+            switch (stage)
+            {
+            case stageRead:
+                m_Start = TickTimeInSeconds();
+                Prepare(false);
+                if (m_Skipped)
+                {
+                    Finish(0);
+                    return false;
+                }
+                if (m_ProfileFormat != profileNone)
+                {
+                    m_CPUStart = DngProfile::CPUTimeInSeconds();
+                    m_Converter.Reset(new DngConverter(m_Options, m_Tracker));
+                    m_Converter->SetProfile(&m_Profile);
+                }
+                else
+                {
+                    m_Converter.Reset(new DngConverter(m_Options, m_Allocator));
+                }
+                m_Converter->ReadFile(m_Filename.c_str());
+                if ((m_Manifest != NULL) && m_Key.empty())
+                {
+                    m_Key = m_Manifest->Key(m_Converter->InputData(), m_Converter->InputSize());
+                    if (m_Manifest->IsCurrent(m_Key, m_OutFilename))
+                    {
+                        // the file was only touched, keep its new quick key
+                        m_Manifest->Record(m_Key, m_QuickKey, m_OutFilename);
+                        m_Skipped = true;
+                        Finish(0);
+                        return false;
+                    }
+                }
+                ok = true;
+                break;
+            case stageDecode:
+                ok = m_Converter->Decode();
+                break;
+            case stageRender:
+                m_Converter->Render();
+                ok = true;
+                break;
+            case stageWrite:
+                m_Converter->Write(m_OutFilename.c_str());
+                if ((m_Manifest != NULL) && !m_Key.empty())
+                    m_Manifest->Record(m_Key, m_QuickKey, m_OutFilename);
+                ok = true;
+                break;
+            }
+        }
+        catch (const dng_exception& except)
+        {
+            fprintf(stderr, "%s: conversion failed with dng error %d\n", m_Filename.c_str(), static_cast<int>(except.ErrorCode()));
+            ok = false;
+        }
+        catch (...)
+        {
+            fprintf(stderr, "%s: conversion failed with unknown error\n", m_Filename.c_str());
+            ok = false;
+        }
+
+        if (!ok || (stage == stageWrite))
+            Finish(ok ? 0 : 1);
+
+        return ok;
     }
-    else if (0 == memcmp("FUJIFILM", rawImage->MakeName().Get(), min(static_cast<uint32>(8), static_cast<uint32>(sizeof(rawImage->MakeName().Get())))))
+
+    void Finish(int result)
     {
-        negative->SetFujiMosaic(0);
+        m_Converter.Reset();
+        if (m_Budget != NULL)
+            m_Budget->Release(m_BudgetBytes);
+
+        m_Result = result;
+        m_Seconds = TickTimeInSeconds() - m_Start;
+        m_Bytes = fileSize(m_Filename.c_str());
+
+        if (m_Verbose)
+        {
+            if (m_Skipped)
+                printf("SKIP   %s -> %s (%.2f s)\n", m_Filename.c_str(), m_OutFilename.c_str(), m_Seconds);
+            else if (m_Result == 0)
+                printf("OK     %s -> %s (%.2f s)\n", m_Filename.c_str(), m_OutFilename.c_str(), m_Seconds);
+            else
+                printf("FAILED %s (%.2f s)\n", m_Filename.c_str(), m_Seconds);
+        }
+
+        if ((m_ProfileFormat != profileNone) && !m_Skipped)
+        {
+            m_Profile.Add("total", m_Seconds, DngProfile::CPUTimeInSeconds() - m_CPUStart, m_Tracker.PeakBytes());
+
+            // one fputs per file keeps concurrent jobs from interleaving
+            // lines, stdout may carry the DNG itself
+            FILE* report = (m_OutFilename == "-") ? stderr : stdout;
+            if (m_ProfileFormat == profileJSON)
+                fputs(m_Profile.FormatJSON(m_Filename.c_str()).c_str(), report);
+            else
+                fputs(m_Profile.FormatText(m_Filename.c_str()).c_str(), report);
+        }
     }
-    else
+
+private:
+    std::string m_Filename;
+    std::string m_OutFilename;
+    const DngConvertOptions& m_Options;
+    dng_memory_allocator& m_Allocator;
+    bool m_Verbose;
+    int m_Result;
+    real64 m_Start;
+    real64 m_Seconds;
+    uint64 m_Bytes;
+    AutoPtr<DngConverter> m_Converter;
+    DngThreadPool** m_Pools;
+    StageJob m_StageJobs[stageCount];
+    ProfileFormat m_ProfileFormat;
+    DngMemoryTracker m_Tracker;
+    DngProfile m_Profile;
+    real64 m_CPUStart;
+    ConvertManifest* m_Manifest;
+    std::string m_Key;
+    std::string m_QuickKey;
+    bool m_Skipped;
+    bool m_Prepared;
+    MemoryBudget* m_Budget;
+    uint64 m_BudgetBytes;
+};
+
+// Waiting files a budget picks from, only these are estimated
+static const uint32 kAdmissionWindow = 8;
+
+// Submits the jobs in input order, or with a budget in the order they fit
+// into it. pool runs whole jobs, or their first stage if pipelined.
+static void submitJobs(const std::vector<ConvertJob*>& jobs, MemoryBudget* budget, DngThreadPool& pool, bool pipelined)
+{
+    std::vector<ConvertJob*> waiting(jobs);
+    std::vector<uint64> sizes;
+
+    while (!waiting.empty())
     {
-        switch(rawImage->Pattern())
+        size_t next = 0;
+        if (budget != NULL)
         {
-        case 0xe1e1e1e1:
-            bayerPhase = 0;
-            break;
-        case 0xb4b4b4b4:
-            bayerPhase = 1;
-            break;
-        case 0x1e1e1e1e:
-            bayerPhase = 2;
-            break;
-        case 0x4b4b4b4b:
-            bayerPhase = 3;
-            break;
+            // only the next few files are estimated, the rest wait their
+            // turn without touching their input
+            size_t window = Min_uint32(kAdmissionWindow, static_cast<uint32>(waiting.size()));
+            sizes.clear();
+            for (size_t i = 0; i < window; i++)
+            {
+                waiting[i]->Prepare(true);
+                sizes.push_back(waiting[i]->BudgetBytes());
+            }
+            next = budget->Acquire(sizes);
         }
-        if (bayerPhase != 0xFFFFFFFF)
-            negative->SetBayerMosaic(bayerPhase);
-    }
 
-    negative->SetWhiteLevel(static_cast<uint32>(rawImage->WhiteLevel(0)), 0);
-    negative->SetWhiteLevel(static_cast<uint32>(rawImage->WhiteLevel(1)), 1);
-    negative->SetWhiteLevel(static_cast<uint32>(rawImage->WhiteLevel(2)), 2);
-    negative->SetWhiteLevel(static_cast<uint32>(rawImage->WhiteLevel(3)), 3);
+        ConvertJob* job = waiting[next];
+        waiting.erase(waiting.begin() + next);
 
-    const dng_mosaic_info* mosaicinfo = negative->GetMosaicInfo();
-    if ((mosaicinfo != NULL) && (mosaicinfo->fCFAPatternSize == dng_point(2, 2)))
-    {
-        negative->SetQuadBlacks(rawImage->BlackLevel(0),
-                                rawImage->BlackLevel(1),
-                                rawImage->BlackLevel(2),
-                                rawImage->BlackLevel(3));
+        if (pipelined)
+            pool.Submit(job->FirstStage());
+        else
+            pool.Submit(job);
     }
-    else
+}
+
+// Hands one file to a dngconvert -serve process
+class RemoteConvertJob : public DngThreadPool::Job
+{
+public:
+    RemoteConvertJob(ConvertClient& client, const std::string& filename, const std::string& outfilename,
+                     const DngConvertOptions& options)
+        : m_Client(client),
+          m_Filename(filename),
+          m_OutFilename(outfilename),
+          m_Options(options),
+          m_Result(-1)
     {
-        negative->SetBlackLevel(rawImage->BlackLevel(0), 0);
     }
 
-    negative->SetBaselineExposure(0.0);
-    negative->SetBaselineNoise(1.0);
-    negative->SetBaselineSharpness(1.0);
+    virtual void Run()
+    {
+        std::string reply;
+        if (!m_Client.Convert(m_Filename, m_OutFilename, m_Options, reply))
+        {
+            fprintf(stderr, "%s: could not reach the conversion server\n", m_Filename.c_str());
+            m_Result = 1;
+            return;
+        }
 
-    negative->SetBaseOrientation(rawImage->Orientation());
+        std::string status = reply.substr(0, reply.find(' '));
+        std::string detail = (status.length() < reply.length()) ? reply.substr(status.length() + 1) : std::string();
 
-    negative->SetAntiAliasStrength(dng_urational(100, 100));
-    negative->SetLinearResponseLimit(1.0);
-    negative->SetShadowScale(dng_urational(1, 1));
+        m_Result = (status == "OK") ? 0 : 1;
+        if (m_Result == 0)
+            printf("OK     %s -> %s (%s s)\n", m_Filename.c_str(), m_OutFilename.c_str(), detail.c_str());
+        else if (status == "FAILED")
+            printf("FAILED %s (%s s)\n", m_Filename.c_str(), detail.c_str());
+        else
+            printf("FAILED %s (%s)\n", m_Filename.c_str(), detail.c_str());
+    }
 
-    negative->SetAnalogBalance(dng_vector_3(1.0, 1.0, 1.0));
+    int Result() const { return m_Result; }
 
-    // -------------------------------------------------------------------------------
+private:
+    ConvertClient& m_Client;
+    std::string m_Filename;
+    std::string m_OutFilename;
+    const DngConvertOptions& m_Options;
+    int m_Result;
+};
 
-    AutoPtr<dng_camera_profile> prof(new dng_camera_profile);
-    if (profilefilename != NULL)
+int main(int argc, const char* argv [])
+{  
+    if(argc == 1)
     {
-        dng_file_stream profStream(profilefilename);
-        prof->ParseExtended(profStream);
+        fprintf(stderr,
+                "\n"
+                "dngconvert - DNG convertion tool\n"
+                "Usage: %s [options] <rawfile|directory|@listfile> [...]\n"
+                "Valid options:\n"
+                "  -camerapreview       build previews from the camera's embedded jpeg\n"
+                "  -client <socket>     send the files to a dngconvert -serve process on <socket>\n"
+                "  -dcp <filename>      use adobe camera profile\n"
+                "  -dcpdir <directory>  use the profile in <directory> made for the camera if -dcp is not given\n"
+                "  -dpl <filename>      include dead pixel list\n"
+                "  -e                   embed original\n"
+                "  -fastpreview         render previews from a downscaled stage 3 image\n"
+                "  -hugepages           back pooled blocks of 2 MB and more with transparent huge pages\n"
+                "  -j <count>           convert <count> files concurrently, 0 uses all cores\n"
+                "  -manifest <filename> skip files converted with the same settings by an earlier run\n"
+                "                       that recorded them in <filename>\n"
+                "  -memlimit <MB>       only start files while their estimated peak memory fits in <MB>,\n"
+                "                       smaller files go ahead of ones that do not fit\n"
+                "  -meta <filename>|-   read exif/xmp from this file, - to disable\n"
+                "  -o <filename>|-      specify output filename (output directory for several inputs),\n"
+                "                       - writes the dng to stdout\n"
+                "  -pool <MB>           keep up to <MB> of freed image buffers for reuse by later files\n"
+                "  -pipeline <r,d,p,w>  overlap files in a pipeline with r read, d decode, p render\n"
+                "                       and w write threads instead of converting whole files per job\n"
+                "  -preview <size>      add another jpeg preview of <size> pixels, may be repeated\n"
+                "  -profile[=json]      print wall time, cpu time and peak memory of each phase\n"
+                "                       and the allocations made by each phase\n"
+                "  -queue <depth>       files waiting in front of each pipeline stage or server thread, default 1\n"
+                "  -serve <socket>      keep running and convert files requested on a local socket\n"
+                "  -threads <count>     threads image processing of a file may use, shared by all files\n"
+                "                       converted at once, default one per core\n",
+                argv[0]);
+
+        return -1;
     }
-    else
+
+    //parse options
+    int index;
+    const char* outfilename = NULL;
+    uint32 jobThreads = 1;
+    bool jobThreadsSet = false;
+    const char* serveSocket = NULL;
+    const char* clientSocket = NULL;
+    bool pipelined = false;
+    uint32 stageThreads[stageCount] = { 1, 1, 1, 1 };
+    uint32 queueDepth = 1;
+    ProfileFormat profileFormat = profileNone;
+    const char* manifestfilename = NULL;
+    const char* profiledirectory = NULL;
+    uint32 poolMegabytes = 0;
+    bool hugePages = false;
+    uint32 memoryLimit = 0;
+    DngConvertOptions options;
+
+    for (index = 1; index < argc && argv [index][0] == '-'; index++)
     {
-        dng_string profName;
-        profName.Append(rawImage->MakeName().Get());
-        profName.Append(" ");
-        profName.Append(rawImage->ModelName().Get());
+        std::string option = &argv[index][1];
 
-        prof->SetName(profName.Get());
-        prof->SetColorMatrix1((dng_matrix) rawImage->ColorMatrix());
-        prof->SetCalibrationIlluminant1(lsD65);
-    }
+        if (0 == strcmp(option.c_str(), "o"))
+        {
+            outfilename = argv[++index];
+        }
 
-    negative->AddProfile(prof);
+        if (0 == strcmp(option.c_str(), "dpl"))
+        {
+            options.deadpixelfilename = argv[++index];
+        }
 
-    negative->SetCameraNeutral(rawImage->CameraNeutral());
+        if (0 == strcmp(option.c_str(), "dcp"))
+        {
+            options.profilefilename = argv[++index];
+        }
 
-    // -----------------------------------------------------------------------------------------
+        if (0 == strcmp(option.c_str(), "dcpdir"))
+        {
+            profiledirectory = argv[++index];
+        }
 
-    if (deadpixelfilename != NULL)
-    {
-        if (bayerPhase != 0xFFFFFFFF)
+        if (0 == strcmp(option.c_str(), "e"))
         {
-            AutoPtr<dng_bad_pixel_list> badPixelList(new dng_bad_pixel_list());
+            options.embedOriginal = true;
+        }
+        
+        if (0 == strcmp(option.c_str(), "meta"))
+        {
+            options.exiffilename = argv[++index];
+        }
 
-            char*cp, line[128];
-            int time, row, col;
-            FILE *fp = fopen(deadpixelfilename, "r");
-            if (fp)
-            {
-                while (fgets (line, 128, fp))
-                {
-                    cp = strchr(line, '#');
-                    if (cp)
-                        *cp = 0;
-                    if (sscanf(line, "%d %d %d", &col, &row, &time) < 2)
-                        continue;
-                    if ((unsigned) col >= image->Width() || (unsigned) row >= image->Height())
-                        continue;
-                    badPixelList->AddPoint(dng_point(row, col));
-                }
-                fclose(fp);
-            }
-            else
-            {
-                fprintf (stderr, "could not read dead pixel file\n");
-                return 1;
-            }
+        if (0 == strcmp(option.c_str(), "fastpreview"))
+        {
+            options.fastPreview = true;
+        }
 
-            AutoPtr<dng_opcode> badPixelOpcode(new dng_opcode_FixBadPixelsList(badPixelList, bayerPhase));
-            negative->OpcodeList1().Append(badPixelOpcode);
+        if (0 == strcmp(option.c_str(), "camerapreview"))
+        {
+            options.cameraPreview = true;
         }
-        else
+
+        if (0 == strcmp(option.c_str(), "preview"))
         {
-            fprintf (stderr, "dead pixel lists are only applyable to bayer images\n");
-            return 1;
+            options.previewSizes.push_back(static_cast<uint32>(atoi(argv[++index])));
         }
-    }
 
-    // -----------------------------------------------------------------------------------------
+        if (0 == strcmp(option.c_str(), "j"))
+        {
+            jobThreads = static_cast<uint32>(atoi(argv[++index]));
+            if (jobThreads == 0)
+                jobThreads = DngThreadPool::ProcessorCount();
+            jobThreadsSet = true;
+        }
 
-    dng_date_time_info dateTimeNow;
-    CurrentDateTimeAndZone(dateTimeNow);
+        if (0 == strcmp(option.c_str(), "profile"))
+        {
+            profileFormat = profileText;
+        }
 
-    dng_string appVersion;
-    appVersion.Append("dngconvert ");
-    appVersion.Append(version());
+        if (0 == strcmp(option.c_str(), "profile=json"))
+        {
+            profileFormat = profileJSON;
+        }
 
-    // Exif CFA Pattern
-    if (mosaicinfo != NULL)
-    {
-      dng_exif* exifData = negative->GetExif();
-      exifData->fCFARepeatPatternCols = mosaicinfo->fCFAPatternSize.v;
-      exifData->fCFARepeatPatternRows = mosaicinfo->fCFAPatternSize.h;
-      for (uint16 c = 0; c < exifData->fCFARepeatPatternCols; c++)
-      {
-        for (uint16 r = 0; r < exifData->fCFARepeatPatternRows; r++)
+        if (0 == strcmp(option.c_str(), "manifest"))
         {
-          exifData->fCFAPattern[r][c] = mosaicinfo->fCFAPattern[c][r];
+            manifestfilename = argv[++index];
         }
-      }
-    }
 
-    bool readFromSidecar = false;
-    if (exiffilename == NULL)
-        // read exif from raw file
-        exiffilename = filename;
-    else
-        readFromSidecar = true;
-    // '-x -' disables exif reading
-    if (strcmp(exiffilename, "-") != 0)
-    {
-        dng_file_stream stream(exiffilename);
-        Exiv2Meta exiv2Meta;
-        exiv2Meta.Parse(host, stream);
-        exiv2Meta.PostParse(host);
+        if (0 == strcmp(option.c_str(), "serve"))
+        {
+            serveSocket = argv[++index];
+        }
 
-        // Exif Data
-        dng_xmp xmpSync(memalloc);
-        dng_exif* exifData = exiv2Meta.GetExif();
-        exifData->fDateTime = dateTimeNow;
-        exifData->fSoftware.Set_ASCII(appVersion.Get());
-        if (exifData != NULL)
+        if (0 == strcmp(option.c_str(), "client"))
         {
-            xmpSync.SyncExif(*exifData);
-            AutoPtr<dng_memory_block> xmpBlock(xmpSync.Serialize());
-            negative->SetXMP(host, xmpBlock->Buffer(), xmpBlock->LogicalSize());
-            negative->SynchronizeMetadata();
+            clientSocket = argv[++index];
         }
 
-        // XMP Data
-        dng_xmp* xmpData = exiv2Meta.GetXMP();
-        if (xmpData != NULL)
+        if (0 == strcmp(option.c_str(), "pipeline"))
         {
-            AutoPtr<dng_memory_block> xmpBlock(xmpData->Serialize());
-            negative->SetXMP(host, xmpBlock->Buffer(), xmpBlock->LogicalSize(), readFromSidecar);
-            negative->SynchronizeMetadata();
+            const char* counts = argv[++index];
+            if (4 != sscanf(counts, "%u,%u,%u,%u", &stageThreads[stageRead], &stageThreads[stageDecode],
+                            &stageThreads[stageRender], &stageThreads[stageWrite]))
+            {
+                fprintf (stderr, "-pipeline expects four thread counts like 1,2,2,1\n");
+                return 1;
+            }
+            pipelined = true;
         }
 
-        // Makernote backup.
-        if ((exiv2Meta.MakerNoteLength() > 0) && (exiv2Meta.MakerNoteByteOrder().Length() == 2))
+        if (0 == strcmp(option.c_str(), "pool"))
         {
-            dng_memory_stream streamPriv(memalloc);
-            streamPriv.SetBigEndian();
+            poolMegabytes = static_cast<uint32>(atoi(argv[++index]));
+        }
 
-            streamPriv.Put("Adobe", 5);
-            streamPriv.Put_uint8(0x00);
-            streamPriv.Put("MakN", 4);
-            streamPriv.Put_uint32(exiv2Meta.MakerNoteLength() + exiv2Meta.MakerNoteByteOrder().Length() + 4);
-            streamPriv.Put(exiv2Meta.MakerNoteByteOrder().Get(), exiv2Meta.MakerNoteByteOrder().Length());
-            streamPriv.Put_uint32(exiv2Meta.MakerNoteOffset());
-            streamPriv.Put(exiv2Meta.MakerNoteData(), exiv2Meta.MakerNoteLength());
-            AutoPtr<dng_memory_block> blockPriv(host.Allocate(static_cast<uint32>(streamPriv.Length())));
-            streamPriv.SetReadPosition(0);
-            streamPriv.Get(blockPriv->Buffer(), static_cast<uint32>(streamPriv.Length()));
-            negative->SetPrivateData(blockPriv);
+        if (0 == strcmp(option.c_str(), "hugepages"))
+        {
+            hugePages = true;
         }
 
-        negative->RebuildIPTC(true, false);
-    }
+        if (0 == strcmp(option.c_str(), "memlimit"))
+        {
+            memoryLimit = static_cast<uint32>(atoi(argv[++index]));
+        }
+
+        if (0 == strcmp(option.c_str(), "threads"))
+        {
+            DngHost::SetThreadCount(Max_uint32(1, static_cast<uint32>(atoi(argv[++index]))));
+        }
 
-    // -----------------------------------------------------------------------------------------
+        if (0 == strcmp(option.c_str(), "queue"))
+        {
+            queueDepth = Max_uint32(1, static_cast<uint32>(atoi(argv[++index])));
+        }
+    }
 
-    negative->SetModelName(negative->GetExif()->fModel.Get());
+    // profiles are parsed once and shared by all files and server requests
+    CameraProfileRegistry profileRegistry(profiledirectory);
+    options.profileRegistry = &profileRegistry;
 
-    // -----------------------------------------------------------------------------------------
+    // declared before the jobs, their blocks go back to it
+    AutoPtr<DngPoolAllocator> pool;
+    if (poolMegabytes > 0)
+        pool.Reset(new DngPoolAllocator(static_cast<uint64>(poolMegabytes) << 20, hugePages));
+    dng_memory_allocator& allocator = (pool.Get() != NULL) ? *pool.Get() : gDefaultDNGMemoryAllocator;
 
-    if (true == embedOriginal)
+    if (serveSocket != NULL)
     {
-        dng_file_stream originalDataStream(filename);
-        originalDataStream.SetReadPosition(0);
+        // conversion options are given per request, -j and -queue size the pool
+        dng_xmp_sdk::InitializeSDK();
 
-        uint32 forkLength = static_cast<uint32>(originalDataStream.Length());
-        uint32 forkBlocks = static_cast<uint32>(floor((forkLength + 65535.0) / 65536.0));
+        ConvertServer server(serveSocket, jobThreadsSet ? jobThreads : DngThreadPool::ProcessorCount(), queueDepth,
+                             &profileRegistry, allocator);
+        int result = server.Run();
 
-        int level = Z_DEFAULT_COMPRESSION;
-        int ret;
-        z_stream zstrm;
-        unsigned char inBuffer[CHUNK];
-        unsigned char outBuffer[CHUNK * 2];
+        dng_xmp_sdk::TerminateSDK();
 
-        dng_memory_stream embedDataStream(memalloc);
-        embedDataStream.SetBigEndian(true);
-        embedDataStream.Put_uint32(forkLength);
+        return result;
+    }
 
-        uint32 offset = (2 + forkBlocks) * sizeof(uint32);
-        embedDataStream.Put_uint32(offset);
+    if (index >= argc)
+    {
+        fprintf (stderr, "no file specified\n");
+        return 1;
+    }
 
-        for (uint32 block = 0; block < forkBlocks; block++)
+    std::vector<std::string> inputs;
+    bool batch = (argc - index) > 1;
+    for (; index < argc; index++)
+    {
+        if (argv[index][0] == '@' || isDirectory(argv[index]))
+            batch = true;
+
+        if (!collectInputs(argv[index], inputs))
         {
-            embedDataStream.Put_uint32(0);
+            fprintf (stderr, "could not read file list %s\n", argv[index] + 1);
+            return 1;
         }
+    }
 
-        for (uint32 block = 0; block < forkBlocks; block++)
-        {
-            uint32 originalBlockLength = static_cast<uint32>(min(static_cast<uint64>(CHUNK), originalDataStream.Length() - originalDataStream.Position()));
-            originalDataStream.Get(inBuffer, originalBlockLength);
+    if (inputs.empty())
+    {
+        fprintf (stderr, "no file specified\n");
+        return 1;
+    }
 
-            /* allocate deflate state */
-            zstrm.zalloc = Z_NULL;
-            zstrm.zfree = Z_NULL;
-            zstrm.opaque = Z_NULL;
-            ret = deflateInit(&zstrm, level);
-            if (ret != Z_OK)
-                return ret;
+    if (batch && (options.exiffilename != NULL) && (strcmp(options.exiffilename, "-") != 0))
+    {
+        fprintf (stderr, "-meta <filename> can not be used with several input files\n");
+        return 1;
+    }
 
-            /* compress */
-            zstrm.avail_in = originalBlockLength;
-            if (zstrm.avail_in == 0)
-                break;
-            zstrm.next_in = inBuffer;
+    bool toStdout = (outfilename != NULL) && (strcmp(outfilename, "-") == 0);
+    if (toStdout && (batch || (clientSocket != NULL)))
+    {
+        fprintf (stderr, "-o - needs a single input file and can not be used with -client\n");
+        return 1;
+    }
 
-            zstrm.avail_out = CHUNK * 2;
-            zstrm.next_out = outBuffer;
-            ret = deflate(&zstrm, Z_FINISH);
-            assert(ret == Z_STREAM_END);
+    if (batch && (outfilename != NULL) && !isDirectory(outfilename))
+    {
+        fprintf (stderr, "output directory %s does not exist\n", outfilename);
+        return 1;
+    }
 
-            uint32 compressedBlockLength = zstrm.total_out;
+    if (clientSocket != NULL)
+    {
+        ConvertClient client(clientSocket);
+        std::vector<RemoteConvertJob*> jobs;
 
-            /* clean up and return */
-            (void)deflateEnd(&zstrm);
+        {
+            DngThreadPool pool(batch ? Min_uint32(jobThreads, static_cast<uint32>(inputs.size())) : 0);
 
-            embedDataStream.SetWritePosition(offset);
-            embedDataStream.Put(outBuffer, compressedBlockLength);
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                std::string out = (!batch && (outfilename != NULL)) ? std::string(outfilename) : outputFilename(inputs[i], outfilename);
+                jobs.push_back(new RemoteConvertJob(client, inputs[i], out, options));
+                pool.Submit(jobs.back());
+            }
 
-            offset += compressedBlockLength;
-            embedDataStream.SetWritePosition((2 + block) * sizeof(int32));
-            embedDataStream.Put_uint32(offset);
+            pool.Wait();
         }
 
-        embedDataStream.SetWritePosition(offset);
-        embedDataStream.Put_uint32(0);
-        embedDataStream.Put_uint32(0);
-        embedDataStream.Put_uint32(0);
-        embedDataStream.Put_uint32(0);
-        embedDataStream.Put_uint32(0);
-        embedDataStream.Put_uint32(0);
-        embedDataStream.Put_uint32(0);
+        int result = 0;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            if (jobs[i]->Result() != 0)
+                result = 1;
+            delete jobs[i];
+        }
+
+        return result;
+    }
 
-        AutoPtr<dng_memory_block> block(host.Allocate(static_cast<uint32>(embedDataStream.Length())));
-        embedDataStream.SetReadPosition(0);
-        embedDataStream.Get(block->Buffer(), static_cast<uint32>(embedDataStream.Length()));
+    AutoPtr<ConvertManifest> manifest;
+    if (manifestfilename != NULL)
+    {
+        if (toStdout)
+        {
+            fprintf (stderr, "-manifest can not be used with -o -\n");
+            return 1;
+        }
 
-        dng_md5_printer md5;
-        md5.Process(block->Buffer(), block->LogicalSize());
-        negative->SetOriginalRawFileData(block);
-        negative->SetOriginalRawFileDigest(md5.Result());
-        negative->ValidateOriginalRawFileDigest();
+        manifest.Reset(new ConvertManifest(manifestfilename, options));
+        if (!manifest->Load())
+        {
+            fprintf (stderr, "could not read manifest %s\n", manifestfilename);
+            return 1;
+        }
     }
 
-    // -----------------------------------------------------------------------------------------
+    dng_xmp_sdk::InitializeSDK();
 
-    // Assign Raw image data.
-    negative->SetStage1Image(image);
+    int result = 0;
 
-    // Compute linearized and range mapped image
-    negative->BuildStage2Image(host);
+    if (!batch)
+    {
+        std::string out = (outfilename != NULL) ? std::string(outfilename) : outputFilename(inputs[0], NULL);
+        ConvertJob job(inputs[0], out, options, false, allocator);
+        job.SetProfileFormat(profileFormat);
+        job.SetManifest(manifest.Get());
+        job.Run();
+        result = job.Result();
+    }
+    else
+    {
+        std::vector<ConvertJob*> jobs;
+        real64 start = TickTimeInSeconds();
+
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            jobs.push_back(new ConvertJob(inputs[i], outputFilename(inputs[i], outfilename), options, true, allocator));
+            jobs.back()->SetProfileFormat(profileFormat);
+            jobs.back()->SetManifest(manifest.Get());
+        }
+
+        // The pipeline's queues already bound the files in flight, with
+        // whole file jobs a reservation is held per thread
+        AutoPtr<MemoryBudget> budget;
+        if (memoryLimit > 0)
+        {
+            budget.Reset(new MemoryBudget(static_cast<uint64>(memoryLimit) << 20,
+                                          pipelined ? 0 : Min_uint32(jobThreads, static_cast<uint32>(inputs.size()))));
+            for (size_t i = 0; i < jobs.size(); i++)
+                jobs[i]->SetBudget(budget.Get());
+        }
+
+        if (pipelined)
+        {
+            // While file N is rendered and written the next files are read
+            // and decoded. The bounded queues keep at most the stage threads
+            // plus queueDepth files per stage in memory.
+            DngThreadPool* pools[stageCount];
+            for (uint32 stage = 0; stage < stageCount; stage++)
+            {
+                uint32 threads = Min_uint32(Max_uint32(1, stageThreads[stage]), static_cast<uint32>(inputs.size()));
+                pools[stage] = new DngThreadPool(threads, queueDepth);
+            }
 
-    // Compute demosaiced image (used by preview and thumbnail)
-    negative->BuildStage3Image(host);
+            for (size_t i = 0; i < jobs.size(); i++)
+                jobs[i]->SetPipeline(pools);
 
-    // -----------------------------------------------------------------------------------------
+            submitJobs(jobs, budget.Get(), *pools[stageRead], true);
 
-    dng_preview_list previewList;
+            // a stage only receives jobs from the one before it, so waiting
+            // for the stages in order drains the whole pipeline
+            for (uint32 stage = 0; stage < stageCount; stage++)
+            {
+                pools[stage]->Wait();
+            }
 
-    AutoPtr<dng_image> jpegImage;
-    dng_render jpeg_render(host, *negative);
-    jpeg_render.SetFinalSpace(dng_space_sRGB::Get());
-    jpeg_render.SetFinalPixelType(ttByte);
-    jpeg_render.SetMaximumSize(1024);
-    jpegImage.Reset(jpeg_render.Render());
+            for (uint32 stage = 0; stage < stageCount; stage++)
+            {
+                delete pools[stage];
+            }
+        }
+        else
+        {
+            DngThreadPool pool(Min_uint32(jobThreads, static_cast<uint32>(inputs.size())));
 
-    DngImageWriter jpeg_writer;
-    AutoPtr<dng_memory_stream> dms(new dng_memory_stream(gDefaultDNGMemoryAllocator));
-    jpeg_writer.WriteJPEG(host, *dms, *jpegImage.Get(), 75, 1);
-    dms->SetReadPosition(0);
+            submitJobs(jobs, budget.Get(), pool, false);
 
-    AutoPtr<dng_jpeg_preview> jpeg_preview;
-    jpeg_preview.Reset(new dng_jpeg_preview);
-    jpeg_preview->fPhotometricInterpretation = piYCbCr;
-    jpeg_preview->fPreviewSize               = jpegImage->Size();
-    jpeg_preview->fYCbCrSubSampling          = dng_point(2, 2);
-    jpeg_preview->fCompressedData.Reset(host.Allocate(static_cast<uint32>(dms->Length())));
-    dms->Get(jpeg_preview->fCompressedData->Buffer_char(), static_cast<uint32>(dms->Length()));
-    jpeg_preview->fInfo.fApplicationName.Set_ASCII("dngconvert");
-    jpeg_preview->fInfo.fApplicationVersion.Set_ASCII(appVersion.Get());
-    jpeg_preview->fInfo.fDateTime = dateTimeNow.Encode_ISO_8601();
-    jpeg_preview->fInfo.fColorSpace = previewColorSpace_sRGB;
+            pool.Wait();
+        }
 
-    AutoPtr<dng_preview> pp(dynamic_cast<dng_preview*>(jpeg_preview.Release()));
-    previewList.Append(pp);
-    dms.Reset();
+        real64 elapsed = TickTimeInSeconds() - start;
 
-    // -----------------------------------------------------------------------------------------
+        uint32 succeeded = 0;
+        uint32 skipped = 0;
+        uint64 bytes = 0;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            if (jobs[i]->Skipped())
+            {
+                skipped++;
+            }
+            else if (jobs[i]->Result() == 0)
+            {
+                succeeded++;
+                bytes += jobs[i]->Bytes();
+            }
+            delete jobs[i];
+        }
 
-    dng_image_preview thumbnail;
-    dng_render thumbnail_render(host, *negative);
-    thumbnail_render.SetFinalSpace(dng_space_sRGB::Get());
-    thumbnail_render.SetFinalPixelType(ttByte);
-    thumbnail_render.SetMaximumSize(256);
-    thumbnail.fImage.Reset(thumbnail_render.Render());
+        printf("\n%u of %u files converted, ", succeeded, static_cast<uint32>(jobs.size()));
+        if (skipped > 0)
+            printf("%u up to date, ", skipped);
+        printf("%u failed, %.2f s elapsed", static_cast<uint32>(jobs.size()) - succeeded - skipped, elapsed);
+        if (elapsed > 0.0)
+            printf(" (%.2f files/s, %.2f MB/s)", succeeded / elapsed, bytes / elapsed / (1024.0 * 1024.0));
+        printf("\n");
 
-    // -----------------------------------------------------------------------------------------
+        if ((budget.Get() != NULL) && (profileFormat != profileNone))
+        {
+            FILE* report = toStdout ? stderr : stdout;
+            if (profileFormat == profileJSON)
+                fprintf(report, "{\"memlimit\":{\"bytes\":%llu,\"peak_reserved\":%llu}}\n",
+                        static_cast<unsigned long long>(memoryLimit) << 20,
+                        static_cast<unsigned long long>(budget->PeakReserved()));
+            else
+                fprintf(report, "memory limit: %u MB, %.1f MB estimated at most\n", memoryLimit,
+                        budget->PeakReserved() / (1024.0 * 1024.0));
+        }
 
-    dng_image_writer writer;
+        result = (succeeded + skipped == jobs.size()) ? 0 : 1;
+    }
 
-    // output filename: replace raw file extension with .dng
-    std::string lpszOutFileName(filename);
-    if (outfilename != NULL)
+    if ((pool.Get() != NULL) && (profileFormat != profileNone))
     {
-        lpszOutFileName.assign(outfilename);
+        FILE* report = toStdout ? stderr : stdout;
+        if (profileFormat == profileJSON)
+            fprintf(report, "{\"pool\":{\"hits\":%llu,\"misses\":%llu,\"cached_bytes\":%llu}}\n",
+                    static_cast<unsigned long long>(pool->Hits()), static_cast<unsigned long long>(pool->Misses()),
+                    static_cast<unsigned long long>(pool->CachedBytes()));
+        else
+            fprintf(report, "memory pool: %llu hits, %llu misses, %.1f MB cached\n",
+                    static_cast<unsigned long long>(pool->Hits()), static_cast<unsigned long long>(pool->Misses()),
+                    pool->CachedBytes() / (1024.0 * 1024.0));
     }
-    else
+
+    if ((manifest.Get() != NULL) && !manifest->Save())
     {
-        found = lpszOutFileName.find_last_of(".");
-        if(found != std::string::npos)
-            lpszOutFileName.resize(found);
-        lpszOutFileName.append(".dng");
+        fprintf (stderr, "could not write manifest %s\n", manifestfilename);
+        result = 1;
     }
 
-    dng_file_stream filestream(lpszOutFileName.c_str(), true);
-
-    writer.WriteDNG(host, filestream, *negative.Get(), thumbnail, ccJPEG, &previewList);
-
     dng_xmp_sdk::TerminateSDK();
 
-    return 0;
+    return result;
 }
-
@@ -0,0 +1,1012 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+   
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public   
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+   
+   This file uses code from dngwriter.cpp -- KDE Kipi-plugins dngconverter utility 
+   (https://projects.kde.org/projects/extragear/graphics/kipi-plugins) utility,
+   dngwriter.cpp is Copyright 2008-2010 by Gilles Caulier <caulier dot gilles at gmail dot com> 
+   and Jens Mueller <tschenser at gmx dot de>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+#include "dng_bad_pixels.h"
+#include "dng_camera_profile.h"
+#include "dng_color_space.h"
+#include "dng_exceptions.h"
+#include "dng_file_stream.h"
+#include "dng_globals.h"
+#include "dng_host.h"
+#include "dng_ifd.h"
+#include "dng_image_writer.h"
+#include "dng_info.h"
+#include "dng_linearization_info.h"
+#include "dng_memory_stream.h"
+#include "dng_mosaic_info.h"
+#include "dng_negative.h"
+#include "dng_preview.h"
+#include "dng_read_image.h"
+#include "dng_render.h"
+#include "dng_resample.h"
+#include "dng_simple_image.h"
+#include "dng_tag_codes.h"
+#include "dng_tag_types.h"
+#include "dng_tag_values.h"
+#include "dng_xmp.h"
+
+#if qWinOS
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "zlib.h"
+#define CHUNK 65536
+
+#include "cameraprofileregistry.h"
+#include "dngconverter.h"
+#include "exiv2meta.h"
+#include "librawimage.h"
+
+#include "dnghost.h"
+#include "dngimagewriter.h"
+#include "dngpipestream.h"
+#include "dngprofile.h"
+#include "dngreadimage.h"
+#include "dngthreadpool.h"
+
+using std::min;
+using std::max;
+
+static const char* version() { return DNGCONVERT_VERSION_STR; }
+
+// The state of one compressOriginal call on the shared thread pool. Every
+// thread working on it takes the next of the independent 64k blocks of the
+// embedded original and reuses its deflate state for all blocks it takes.
+class DeflateRun
+{
+public:
+    DeflateRun(const uint8* data, uint32 length, uint8* output, uint32 outputStride, uint32* outputLengths)
+        : m_Data(data),
+          m_Length(length),
+          m_Blocks((length + CHUNK - 1) / CHUNK),
+          m_Output(output),
+          m_OutputStride(outputStride),
+          m_OutputLengths(outputLengths),
+          m_Mutex("DeflateRun"),
+#if qDNGThreadSafe
+          m_JobsDone(),
+#endif
+          m_NextBlock(0),
+          m_Running(0),
+          m_Error(dng_error_none)
+    {
+    }
+
+    // Compresses blocks until none are left
+    void Process()
+    {
+        z_stream zstrm;
+        zstrm.zalloc = Z_NULL;
+        zstrm.zfree = Z_NULL;
+        zstrm.opaque = Z_NULL;
+        if (deflateInit(&zstrm, Z_DEFAULT_COMPRESSION) != Z_OK)
+        {
+            Fail(dng_error_memory);
+            return;
+        }
+
+        uint32 block;
+        while (NextBlock(block))
+        {
+            deflateReset(&zstrm);
+
+            zstrm.next_in = (Bytef*) (m_Data + block * CHUNK);
+            zstrm.avail_in = min(static_cast<uint32>(CHUNK), m_Length - block * CHUNK);
+            zstrm.next_out = m_Output + block * m_OutputStride;
+            zstrm.avail_out = m_OutputStride;
+
+            if (deflate(&zstrm, Z_FINISH) != Z_STREAM_END)
+            {
+                Fail(dng_error_unknown);
+                break;
+            }
+
+            m_OutputLengths[block] = static_cast<uint32>(zstrm.total_out);
+        }
+
+        (void)deflateEnd(&zstrm);
+    }
+
+    void Submitted()
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        m_Running++;
+    }
+
+    void Finished()
+    {
+        dng_lock_mutex lock(&m_Mutex);
+#if qDNGThreadSafe
+        if (--m_Running == 0)
+            m_JobsDone.Broadcast();
+#else
+        m_Running--;
+#endif
+    }
+
+    // Waits for the jobs the pool picked up and rethrows the first error
+    void Wait()
+    {
+        dng_error_code result;
+        {
+            dng_lock_mutex lock(&m_Mutex);
+#if qDNGThreadSafe
+            while (m_Running > 0)
+            {
+                m_JobsDone.Wait(m_Mutex);
+            }
+#endif
+            result = m_Error;
+        }
+
+        if (result != dng_error_none)
+            Throw_dng_error(result);
+    }
+
+private:
+    // the remaining blocks are skipped once one of them failed
+    bool NextBlock(uint32& block)
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        if (m_Error != dng_error_none || m_NextBlock >= m_Blocks)
+            return false;
+        block = m_NextBlock++;
+        return true;
+    }
+
+    void Fail(dng_error_code error)
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        if (m_Error == dng_error_none)
+            m_Error = error;
+    }
+
+    const uint8* m_Data;
+    uint32 m_Length;
+    uint32 m_Blocks;
+    uint8* m_Output;
+    uint32 m_OutputStride;
+    uint32* m_OutputLengths;
+    dng_mutex m_Mutex;
+#if qDNGThreadSafe
+    dng_condition m_JobsDone;
+#endif
+    uint32 m_NextBlock;
+    uint32 m_Running;
+    dng_error_code m_Error;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DeflateRun(const DeflateRun& run);
+    DeflateRun& operator=(const DeflateRun& run);
+};
+
+class DeflateJob : public DngThreadPool::Job
+{
+public:
+    DeflateJob(DeflateRun* run)
+        : m_Run(run)
+    {
+    }
+
+    // Called by the pool's thread
+    virtual void Run()
+    {
+        m_Run->Process();
+        m_Run->Finished();
+    }
+
+private:
+    DeflateRun* m_Run;
+};
+
+static void putBigEndian32(uint8* p, uint32 value)
+{
+    p[0] = static_cast<uint8>(value >> 24);
+    p[1] = static_cast<uint8>(value >> 16);
+    p[2] = static_cast<uint8>(value >> 8);
+    p[3] = static_cast<uint8>(value);
+}
+
+// Builds the OriginalRawFileData block: fork length, block offset table,
+// deflated 64k blocks and an empty resource fork header. The blocks are
+// compressed on the shared thread pool and assembled in order afterwards.
+static dng_memory_block* compressOriginal(dng_host& host, const uint8* data, uint32 length)
+{
+    uint32 forkBlocks = (length + CHUNK - 1) / CHUNK;
+    uint32 stride = static_cast<uint32>(compressBound(CHUNK));
+
+    AutoPtr<dng_memory_block> compressed(host.Allocate(Max_uint32(1, forkBlocks) * stride));
+    AutoPtr<dng_memory_block> lengths(host.Allocate(Max_uint32(1, forkBlocks) * sizeof(uint32)));
+    uint32* blockLengths = lengths->Buffer_uint32();
+
+    {
+        // The calling thread compresses blocks too. Jobs the pool has not
+        // started once the caller ran out of blocks are taken back, so a
+        // pool kept busy by other conversions never holds up this one.
+        DngThreadPool& pool = DngHost::SharedThreadPool();
+        DeflateRun run(data, length, compressed->Buffer_uint8(), stride, blockLengths);
+
+        uint32 jobCount = Min_uint32(DngHost::ThreadCount(), Min_uint32(pool.Threads() + 1, forkBlocks));
+        jobCount = Max_uint32(jobCount, 1);
+
+        std::vector<DeflateJob> jobs(jobCount, DeflateJob(&run));
+        for (uint32 i = 1; i < jobCount; i++)
+        {
+            run.Submitted();
+            pool.Submit(&jobs[i]);
+        }
+
+        run.Process();
+
+        for (uint32 i = 1; i < jobCount; i++)
+        {
+            if (pool.Withdraw(&jobs[i]))
+                run.Finished();
+        }
+
+        run.Wait();
+    }
+
+    uint32 headerSize = (2 + forkBlocks) * sizeof(uint32);
+    uint32 totalSize = headerSize + 7 * sizeof(uint32);
+    for (uint32 block = 0; block < forkBlocks; block++)
+        totalSize += blockLengths[block];
+
+    AutoPtr<dng_memory_block> result(host.Allocate(totalSize));
+    uint8* output = result->Buffer_uint8();
+
+    uint32 offset = headerSize;
+    putBigEndian32(output, length);
+    putBigEndian32(output + sizeof(uint32), offset);
+
+    for (uint32 block = 0; block < forkBlocks; block++)
+    {
+        memcpy(output + offset, compressed->Buffer_uint8() + block * stride, blockLengths[block]);
+        offset += blockLengths[block];
+        putBigEndian32(output + (2 + block) * sizeof(uint32), offset);
+    }
+
+    memset(output + offset, 0, 7 * sizeof(uint32));
+
+    return result.Release();
+}
+
+// Resamples an already rendered image so that its longer side is at most
+// maximumSize, keeping the aspect ratio like dng_render does
+static dng_image* downscaleImage(dng_host& host, const dng_image& image, uint32 maximumSize)
+{
+    dng_point srcSize = image.Size();
+
+    if (Max_uint32(srcSize.h, srcSize.v) <= maximumSize)
+        return image.Clone();
+
+    real64 ratio = srcSize.h / static_cast<real64>(srcSize.v);
+
+    dng_point dstSize;
+    if (srcSize.h >= srcSize.v)
+    {
+        dstSize.h = maximumSize;
+        dstSize.v = Max_uint32(1, Round_uint32(dstSize.h / ratio));
+    }
+    else
+    {
+        dstSize.v = maximumSize;
+        dstSize.h = Max_uint32(1, Round_uint32(dstSize.v * ratio));
+    }
+
+    AutoPtr<dng_image> result(host.Make_dng_image(dng_rect(dstSize), image.Planes(), image.PixelType()));
+
+    ResampleImage(host, image, *result, image.Bounds(), result->Bounds(), dng_resample_bicubic::Get());
+
+    return result.Release();
+}
+
+static dng_preview* makeJpegPreview(dng_host& host, const dng_image& image,
+                                    const dng_string& appVersion, const dng_date_time_info& dateTime)
+{
+    DngImageWriter jpeg_writer;
+    AutoPtr<dng_memory_stream> dms(new dng_memory_stream(host.Allocator()));
+    jpeg_writer.WriteJPEG(host, *dms, image, 75, 1);
+    dms->SetReadPosition(0);
+
+    AutoPtr<dng_jpeg_preview> jpeg_preview;
+    jpeg_preview.Reset(new dng_jpeg_preview);
+    jpeg_preview->fPhotometricInterpretation = piYCbCr;
+    jpeg_preview->fPreviewSize               = image.Size();
+    jpeg_preview->fYCbCrSubSampling          = dng_point(2, 2);
+    jpeg_preview->fCompressedData.Reset(host.Allocate(static_cast<uint32>(dms->Length())));
+    dms->Get(jpeg_preview->fCompressedData->Buffer_char(), static_cast<uint32>(dms->Length()));
+    jpeg_preview->fInfo.fApplicationName.Set_ASCII("dngconvert");
+    jpeg_preview->fInfo.fApplicationVersion.Set_ASCII(appVersion.Get());
+    jpeg_preview->fInfo.fDateTime = dateTime.Encode_ISO_8601();
+    jpeg_preview->fInfo.fColorSpace = previewColorSpace_sRGB;
+
+    return jpeg_preview.Release();
+}
+
+DngConverter::DngConverter(const DngConvertOptions& options, dng_memory_allocator& allocator)
+    : m_Options(options),
+      m_Allocator(allocator),
+      m_Host(&m_Allocator),
+      m_Name(),
+      m_RawData(),
+      m_RawBuffer(NULL),
+      m_RawSize(0),
+      m_Image(),
+      m_RawImage(NULL),
+      m_Negative(),
+      m_AppVersion(),
+      m_DateTime(),
+      m_PreviewList(),
+      m_Thumbnail(),
+      m_Profile(NULL)
+{
+    m_Host.SetSaveDNGVersion(dngVersion_SaveDefault);
+    m_Host.SetSaveLinearDNG(false);
+    m_Host.SetKeepOriginalFile(true);
+}
+
+DngConverter::~DngConverter(void)
+{
+}
+
+// Tile buffers, JPEG previews, metadata and the SDK's other small
+// allocations on top of the full size images
+static const uint64 kEstimateOverheadBytes = 32 << 20;
+
+// Limits for walking the IFDs of files that are not TIFF after all
+static const uint32 kProbeMaxIFDs = 32;
+static const uint32 kProbeMaxEntries = 1024;
+
+// Size of the largest image in a TIFF based raw file, from its IFDs and
+// SubIFDs alone. IFDs tagged as CFA or LinearRaw data win over previews,
+// untagged raw IFDs are taken as a mosaic. False if stream is not TIFF.
+static bool probeTiffSize(dng_stream& stream, uint32& width, uint32& height, uint32& planes)
+{
+    stream.SetReadPosition(0);
+    uint16 byteOrder = stream.Get_uint16();
+    if (byteOrder != byteOrderII && byteOrder != byteOrderMM)
+        return false;
+    stream.SetBigEndian(byteOrder == byteOrderMM);
+
+    uint16 magic = stream.Get_uint16();
+    if (magic != magicTIFF && magic != magicPanasonic && magic != magicOlympusA && magic != magicOlympusB)
+        return false;
+
+    std::vector<uint64> pending(1, stream.Get_uint32());
+    std::vector<uint64> visited;
+
+    uint64 bestArea = 0;
+    bool bestIsRaw = false;
+    width = height = 0;
+    planes = 1;
+
+    while (!pending.empty() && visited.size() < kProbeMaxIFDs)
+    {
+        uint64 offset = pending.back();
+        pending.pop_back();
+        if (offset < 8 || offset >= stream.Length() ||
+            std::find(visited.begin(), visited.end(), offset) != visited.end())
+            continue;
+        visited.push_back(offset);
+
+        stream.SetReadPosition(offset);
+        uint32 entries = Min_uint32(stream.Get_uint16(), kProbeMaxEntries);
+
+        uint32 ifdWidth = 0;
+        uint32 ifdHeight = 0;
+        uint32 samples = 1;
+        uint32 photometric = 0xFFFFFFFF;
+
+        for (uint32 i = 0; i < entries; i++)
+        {
+            uint64 entry = offset + 2 + i * 12;
+            stream.SetReadPosition(entry);
+            uint16 tag = stream.Get_uint16();
+            uint16 type = stream.Get_uint16();
+            uint32 count = stream.Get_uint32();
+            uint32 value = (type == ttShort) ? stream.Get_uint16() : stream.Get_uint32();
+
+            switch (tag)
+            {
+            case tcImageWidth:
+                ifdWidth = value;
+                break;
+            case tcImageLength:
+                ifdHeight = value;
+                break;
+            case tcSamplesPerPixel:
+                samples = value;
+                break;
+            case tcPhotometricInterpretation:
+                photometric = value;
+                break;
+            case tcSubIFDs:
+                if (count == 1)
+                {
+                    pending.push_back(value);
+                }
+                else if (count <= kProbeMaxIFDs)
+                {
+                    stream.SetReadPosition(value);
+                    for (uint32 j = 0; j < count; j++)
+                        pending.push_back(stream.Get_uint32());
+                }
+                break;
+            }
+        }
+
+        stream.SetReadPosition(offset + 2 + entries * 12);
+        pending.push_back(stream.Get_uint32());
+
+        bool isRaw = (photometric == piCFA) || (photometric == piLinearRaw);
+        uint64 area = static_cast<uint64>(ifdWidth) * ifdHeight;
+        if ((isRaw && !bestIsRaw) || ((isRaw == bestIsRaw) && area > bestArea))
+        {
+            bestArea = area;
+            bestIsRaw = isRaw;
+            width = ifdWidth;
+            height = ifdHeight;
+            planes = (photometric == piLinearRaw) ? Pin_uint32(1, samples, 4) : 1;
+        }
+    }
+
+    return bestArea > 0;
+}
+
+uint64 DngConverter::EstimatePeakBytes(const char* filename, const DngConvertOptions& options)
+{
+    uint64 fileBytes = 0;
+    uint32 width = 0;
+    uint32 height = 0;
+    uint32 planes = 1;
+    uint32 channels = 3;
+    bool probed = false;
+
+    try
+    {
+        dng_file_stream stream(filename);
+        fileBytes = stream.Length();
+        probed = probeTiffSize(stream, width, height, planes);
+    }
+    catch (...)
+    {
+        probed = false;
+    }
+
+    // other raw formats hold about a byte per pixel of a mosaic
+    uint64 pixels = probed ? static_cast<uint64>(width) * height : fileBytes;
+    uint64 pixelSize = TagTypeSize(ttShort);
+
+    // stage 1 and the 16 bit linearized stage 2 have the raw layout,
+    // stage 3 has a plane per color channel
+    uint64 rawBytes = pixels * planes * pixelSize;
+    uint64 stage3Bytes = pixels * Max_uint32(planes, channels) * pixelSize;
+
+    uint32 renderSize = 1024;
+    for (size_t i = 0; i < options.previewSizes.size(); i++)
+        renderSize = Max_uint32(renderSize, options.previewSizes[i]);
+
+    // the mosaic is interpolated at an integer fraction of its size, which
+    // may leave up to twice the preview size on each side
+    if (options.fastPreview)
+        stage3Bytes = Min_uint64(stage3Bytes, 4 * static_cast<uint64>(renderSize) * renderSize * Max_uint32(planes, channels) * pixelSize);
+
+    uint64 originalBytes = options.embedOriginal ? fileBytes : 0;
+
+    // While decoding the file, LibRaw's unpacked data and the stage 1 copy
+    // are held; while rendering, stage 1 to 3, the compressed original and
+    // the 8 bit rendered preview.
+    uint64 decodeBytes = fileBytes + 2 * rawBytes + originalBytes;
+    uint64 renderBytes = 2 * rawBytes + stage3Bytes + originalBytes + static_cast<uint64>(renderSize) * renderSize * 3;
+
+    return Max_uint64(decodeBytes, renderBytes) + kEstimateOverheadBytes;
+}
+
+void DngConverter::SetProfile(DngProfile* profile)
+{
+    m_Profile = profile;
+}
+
+bool DngConverter::Convert(const char* filename, const char* outfilename)
+{
+    ReadFile(filename);
+    if (!Decode())
+        return false;
+    Render();
+    Write(outfilename);
+    return true;
+}
+
+bool DngConverter::Convert(dng_stream& input, dng_stream& output, const char* name)
+{
+    ReadStream(input, name);
+    if (!Decode())
+        return false;
+    Render();
+    Write(output);
+    return true;
+}
+
+dng_memory_block* DngConverter::Convert(const void* data, uint32 size, const char* name)
+{
+    SetInput(data, size, name);
+    if (!Decode())
+        return NULL;
+    Render();
+    return WriteToMemory();
+}
+
+// Read the raw file once, LibRaw, Exiv2 and the embedded original all
+// work on streams over this block
+void DngConverter::ReadFile(const char* filename)
+{
+    dng_file_stream rawFileStream(filename);
+    ReadStream(rawFileStream, filename);
+}
+
+void DngConverter::ReadStream(dng_stream& stream, const char* name)
+{
+    DngProfileScope scope(m_Profile, "read");
+    m_RawData.Reset(stream.AsMemoryBlock(m_Allocator));
+    SetInput(m_RawData->Buffer(), m_RawData->LogicalSize(), name);
+}
+
+void DngConverter::SetInput(const void* data, uint32 size, const char* name)
+{
+    m_Name = name;
+    m_RawBuffer = static_cast<const uint8*>(data);
+    m_RawSize = size;
+}
+
+bool DngConverter::Decode()
+{
+    m_Image.Reset(new LibRawImage(m_RawBuffer, m_RawSize, m_Allocator, m_Options.cameraPreview, m_Profile));
+    m_RawImage = static_cast<LibRawImage*>(m_Image.Get());
+    if (m_RawImage->Bounds().IsEmpty())
+    {
+        fprintf(stderr, "%s: could not read raw data\n", m_Name.c_str());
+        return false;
+    }
+
+    // -----------------------------------------------------------------------------------------
+
+    m_Negative.Reset(m_Host.Make_dng_negative());
+
+    m_Negative->SetDefaultScale(m_RawImage->DefaultScaleH(), m_RawImage->DefaultScaleV());
+    m_Negative->SetDefaultCropOrigin(m_RawImage->DefaultCropOriginH(), m_RawImage->DefaultCropOriginV());
+    m_Negative->SetDefaultCropSize(m_RawImage->DefaultCropSizeH(), m_RawImage->DefaultCropSizeV());
+    m_Negative->SetActiveArea(m_RawImage->ActiveArea());
+
+    std::string file(m_Name);
+    size_t found = min(file.rfind("\\"), file.rfind("/"));
+    if (found != std::string::npos)
+        file = file.substr(found + 1, file.length() - found - 1);
+    m_Negative->SetOriginalRawFileName(file.c_str());
+
+    m_Negative->SetColorChannels(m_RawImage->Channels());
+    m_Negative->SetColorKeys(m_RawImage->ColorKey(0), m_RawImage->ColorKey(1), m_RawImage->ColorKey(2), m_RawImage->ColorKey(3));
+
+    uint32 bayerPhase = 0xFFFFFFFF;
+    if (m_RawImage->Channels() == 4)
+    {
+        m_Negative->SetQuadMosaic(m_RawImage->Pattern());
+    }
+    else if (0 == memcmp("FUJIFILM", m_RawImage->MakeName().Get(), min(static_cast<uint32>(8), static_cast<uint32>(sizeof(m_RawImage->MakeName().Get())))))
+    {
+        m_Negative->SetFujiMosaic(0);
+    }
+    else
+    {
+        switch(m_RawImage->Pattern())
+        {
+        case 0xe1e1e1e1:
+            bayerPhase = 0;
+            break;
+        case 0xb4b4b4b4:
+            bayerPhase = 1;
+            break;
+        case 0x1e1e1e1e:
+            bayerPhase = 2;
+            break;
+        case 0x4b4b4b4b:
+            bayerPhase = 3;
+            break;
+        }
+        if (bayerPhase != 0xFFFFFFFF)
+            m_Negative->SetBayerMosaic(bayerPhase);
+    }
+
+    m_Negative->SetWhiteLevel(static_cast<uint32>(m_RawImage->WhiteLevel(0)), 0);
+    m_Negative->SetWhiteLevel(static_cast<uint32>(m_RawImage->WhiteLevel(1)), 1);
+    m_Negative->SetWhiteLevel(static_cast<uint32>(m_RawImage->WhiteLevel(2)), 2);
+    m_Negative->SetWhiteLevel(static_cast<uint32>(m_RawImage->WhiteLevel(3)), 3);
+
+    const dng_mosaic_info* mosaicinfo = m_Negative->GetMosaicInfo();
+    if ((mosaicinfo != NULL) && (mosaicinfo->fCFAPatternSize == dng_point(2, 2)))
+    {
+        m_Negative->SetQuadBlacks(m_RawImage->BlackLevel(0),
+                                  m_RawImage->BlackLevel(1),
+                                  m_RawImage->BlackLevel(2),
+                                  m_RawImage->BlackLevel(3));
+    }
+    else
+    {
+        m_Negative->SetBlackLevel(m_RawImage->BlackLevel(0), 0);
+    }
+
+    m_Negative->SetBaselineExposure(0.0);
+    m_Negative->SetBaselineNoise(1.0);
+    m_Negative->SetBaselineSharpness(1.0);
+
+    m_Negative->SetBaseOrientation(m_RawImage->Orientation());
+
+    m_Negative->SetAntiAliasStrength(dng_urational(100, 100));
+    m_Negative->SetLinearResponseLimit(1.0);
+    m_Negative->SetShadowScale(dng_urational(1, 1));
+
+    m_Negative->SetAnalogBalance(dng_vector_3(1.0, 1.0, 1.0));
+
+    // -------------------------------------------------------------------------------
+
+    dng_string profName;
+    profName.Append(m_RawImage->MakeName().Get());
+    profName.Append(" ");
+    profName.Append(m_RawImage->ModelName().Get());
+
+    AutoPtr<dng_camera_profile> prof;
+    if (m_Options.profileRegistry != NULL)
+    {
+        CameraProfileRegistry* registry = m_Options.profileRegistry;
+        if (m_Options.profilefilename != NULL)
+            prof.Reset(registry->ProfileFromFile(m_Options.profilefilename));
+        else
+            prof.Reset(registry->ProfileForCamera(profName.Get()));
+
+        if (!prof.Get())
+            prof.Reset(registry->MatrixProfile(profName.Get(), (dng_matrix) m_RawImage->ColorMatrix()));
+    }
+    else if (m_Options.profilefilename != NULL)
+    {
+        prof.Reset(new dng_camera_profile);
+        dng_file_stream profStream(m_Options.profilefilename);
+        prof->ParseExtended(profStream);
+    }
+    else
+    {
+        prof.Reset(new dng_camera_profile);
+        prof->SetName(profName.Get());
+        prof->SetColorMatrix1((dng_matrix) m_RawImage->ColorMatrix());
+        prof->SetCalibrationIlluminant1(lsD65);
+    }
+
+    m_Negative->AddProfile(prof);
+
+    m_Negative->SetCameraNeutral(m_RawImage->CameraNeutral());
+
+    // -----------------------------------------------------------------------------------------
+
+    if (m_Options.deadpixelfilename != NULL)
+    {
+        if (bayerPhase != 0xFFFFFFFF)
+        {
+            AutoPtr<dng_bad_pixel_list> badPixelList(new dng_bad_pixel_list());
+
+            char*cp, line[128];
+            int time, row, col;
+            FILE *fp = fopen(m_Options.deadpixelfilename, "r");
+            if (fp)
+            {
+                while (fgets (line, 128, fp))
+                {
+                    cp = strchr(line, '#');
+                    if (cp)
+                        *cp = 0;
+                    if (sscanf(line, "%d %d %d", &col, &row, &time) < 2)
+                        continue;
+                    if ((unsigned) col >= m_Image->Width() || (unsigned) row >= m_Image->Height())
+                        continue;
+                    badPixelList->AddPoint(dng_point(row, col));
+                }
+                fclose(fp);
+            }
+            else
+            {
+                fprintf (stderr, "could not read dead pixel file\n");
+                return false;
+            }
+
+            AutoPtr<dng_opcode> badPixelOpcode(new dng_opcode_FixBadPixelsList(badPixelList, bayerPhase));
+            m_Negative->OpcodeList1().Append(badPixelOpcode);
+        }
+        else
+        {
+            fprintf (stderr, "dead pixel lists are only applyable to bayer images\n");
+            return false;
+        }
+    }
+
+    // -----------------------------------------------------------------------------------------
+
+    CurrentDateTimeAndZone(m_DateTime);
+
+    m_AppVersion.Append("dngconvert ");
+    m_AppVersion.Append(version());
+
+    // Exif CFA Pattern
+    if (mosaicinfo != NULL)
+    {
+      dng_exif* exifData = m_Negative->GetExif();
+      exifData->fCFARepeatPatternCols = mosaicinfo->fCFAPatternSize.v;
+      exifData->fCFARepeatPatternRows = mosaicinfo->fCFAPatternSize.h;
+      for (uint16 c = 0; c < exifData->fCFARepeatPatternCols; c++)
+      {
+        for (uint16 r = 0; r < exifData->fCFARepeatPatternRows; r++)
+        {
+          exifData->fCFAPattern[r][c] = mosaicinfo->fCFAPattern[c][r];
+        }
+      }
+    }
+
+    // exif is read from the raw data unless a sidecar is given, '-meta -' disables it
+    const char* exiffilename = m_Options.exiffilename;
+    bool readFromSidecar = (exiffilename != NULL);
+    if (!readFromSidecar || (strcmp(exiffilename, "-") != 0))
+    {
+        AutoPtr<dng_stream> stream;
+        if (readFromSidecar)
+            stream.Reset(new dng_file_stream(exiffilename));
+        else
+            stream.Reset(new dng_stream(m_RawBuffer, m_RawSize));
+        Exiv2Meta exiv2Meta;
+        {
+            DngProfileScope scope(m_Profile, "exiv2 parse");
+            exiv2Meta.Parse(m_Host, *stream);
+            exiv2Meta.PostParse(m_Host);
+        }
+
+        DngProfileScope syncScope(m_Profile, "metadata sync");
+
+        // Exif Data
+        dng_xmp xmpSync(m_Allocator);
+        dng_exif* exifData = exiv2Meta.GetExif();
+        exifData->fDateTime = m_DateTime;
+        exifData->fSoftware.Set_ASCII(m_AppVersion.Get());
+        if (exifData != NULL)
+        {
+            xmpSync.SyncExif(*exifData);
+            AutoPtr<dng_memory_block> xmpBlock(xmpSync.Serialize());
+            m_Negative->SetXMP(m_Host, xmpBlock->Buffer(), xmpBlock->LogicalSize());
+            m_Negative->SynchronizeMetadata();
+        }
+
+        // XMP Data
+        dng_xmp* xmpData = exiv2Meta.GetXMP();
+        if (xmpData != NULL)
+        {
+            AutoPtr<dng_memory_block> xmpBlock(xmpData->Serialize());
+            m_Negative->SetXMP(m_Host, xmpBlock->Buffer(), xmpBlock->LogicalSize(), readFromSidecar);
+            m_Negative->SynchronizeMetadata();
+        }
+
+        // Makernote backup.
+        if ((exiv2Meta.MakerNoteLength() > 0) && (exiv2Meta.MakerNoteByteOrder().Length() == 2))
+        {
+            dng_memory_stream streamPriv(m_Allocator);
+            streamPriv.SetBigEndian();
+
+            streamPriv.Put("Adobe", 5);
+            streamPriv.Put_uint8(0x00);
+            streamPriv.Put("MakN", 4);
+            streamPriv.Put_uint32(exiv2Meta.MakerNoteLength() + exiv2Meta.MakerNoteByteOrder().Length() + 4);
+            streamPriv.Put(exiv2Meta.MakerNoteByteOrder().Get(), exiv2Meta.MakerNoteByteOrder().Length());
+            streamPriv.Put_uint32(exiv2Meta.MakerNoteOffset());
+            streamPriv.Put(exiv2Meta.MakerNoteData(), exiv2Meta.MakerNoteLength());
+            AutoPtr<dng_memory_block> blockPriv(m_Host.Allocate(static_cast<uint32>(streamPriv.Length())));
+            streamPriv.SetReadPosition(0);
+            streamPriv.Get(blockPriv->Buffer(), static_cast<uint32>(streamPriv.Length()));
+            m_Negative->SetPrivateData(blockPriv);
+        }
+
+        m_Negative->RebuildIPTC(true, false);
+    }
+
+    // -----------------------------------------------------------------------------------------
+
+    m_Negative->SetModelName(m_Negative->GetExif()->fModel.Get());
+
+    // -----------------------------------------------------------------------------------------
+
+    if (true == m_Options.embedOriginal)
+    {
+        DngProfileScope embedScope(m_Profile, "embed original");
+        AutoPtr<dng_memory_block> block(compressOriginal(m_Host, m_RawBuffer, m_RawSize));
+        embedScope.Stop();
+
+        DngProfileScope digestScope(m_Profile, "original digest");
+        dng_md5_printer md5;
+        md5.Process(block->Buffer(), block->LogicalSize());
+        m_Negative->SetOriginalRawFileData(block);
+        m_Negative->SetOriginalRawFileDigest(md5.Result());
+        m_Negative->ValidateOriginalRawFileDigest();
+    }
+
+    // -----------------------------------------------------------------------------------------
+
+    // The raw file is no longer needed once metadata and original are copied
+    m_RawData.Reset();
+    m_RawBuffer = NULL;
+    m_RawSize = 0;
+
+    return true;
+}
+
+void DngConverter::Render()
+{
+    std::vector<uint32> previewSizes(1, 1024);
+    previewSizes.insert(previewSizes.end(), m_Options.previewSizes.begin(), m_Options.previewSizes.end());
+    std::sort(previewSizes.begin(), previewSizes.end(), std::greater<uint32>());
+    previewSizes.erase(std::unique(previewSizes.begin(), previewSizes.end()), previewSizes.end());
+
+    uint32 renderSize = Max_uint32(previewSizes[0], 256);
+
+    // The camera's own JPEG is decoded instead of rendering the raw data,
+    // previews and thumbnail are downsampled from it like from a rendered image
+    AutoPtr<dng_image> renderedImage;
+    if (m_Options.cameraPreview)
+    {
+        const dng_memory_block* embedded = m_RawImage->EmbeddedPreview();
+        DngProfileScope scope(m_Profile, "decode embedded");
+        if (embedded != NULL)
+            renderedImage.Reset(DngReadImage::DecodeJPEG(m_Host, embedded->Buffer(), embedded->LogicalSize(), renderSize));
+
+        if (renderedImage.Get() == NULL)
+            fprintf(stderr, "%s: no usable embedded preview, rendering the raw data\n", m_Name.c_str());
+    }
+
+    // Assign Raw image data.
+    m_Negative->SetStage1Image(m_Image);
+
+    if (renderedImage.Get() == NULL)
+    {
+        // Compute linearized and range mapped image
+        {
+            DngProfileScope scope(m_Profile, "stage 2");
+            m_Negative->BuildStage2Image(m_Host);
+        }
+
+        if (m_Options.fastPreview)
+        {
+            // Stage 3 is only used for the previews, so let the mosaic info
+            // interpolate a downscaled image close to the largest preview size
+            m_Host.SetPreferredSize(renderSize);
+            m_Host.ValidateSizes();
+        }
+
+        // Compute demosaiced image (used by preview and thumbnail)
+        {
+            DngProfileScope scope(m_Profile, "stage 3");
+            m_Negative->BuildStage3Image(m_Host);
+        }
+
+        // -----------------------------------------------------------------------------------------
+
+        // Render the largest preview once, all smaller sizes and the thumbnail
+        // are downsampled from the rendered 8 bit image
+        dng_render preview_render(m_Host, *m_Negative);
+        preview_render.SetFinalSpace(dng_space_sRGB::Get());
+        preview_render.SetFinalPixelType(ttByte);
+        preview_render.SetMaximumSize(renderSize);
+        DngProfileScope scope(m_Profile, "render");
+        renderedImage.Reset(preview_render.Render());
+    }
+
+    for (size_t i = 0; i < previewSizes.size() && m_PreviewList.Count() < kMaxDNGPreviews; i++)
+    {
+        DngProfileScope resampleScope(m_Profile, "resample");
+        AutoPtr<dng_image> jpegImage(downscaleImage(m_Host, *renderedImage, previewSizes[i]));
+        resampleScope.Stop();
+
+        DngProfileScope encodeScope(m_Profile, "jpeg encode");
+        AutoPtr<dng_preview> pp(makeJpegPreview(m_Host, *jpegImage, m_AppVersion, m_DateTime));
+        m_PreviewList.Append(pp);
+    }
+
+    // -----------------------------------------------------------------------------------------
+
+    {
+        DngProfileScope scope(m_Profile, "resample");
+        m_Thumbnail.fImage.Reset(downscaleImage(m_Host, *renderedImage, 256));
+    }
+
+    renderedImage.Reset();
+}
+
+void DngConverter::Write(dng_stream& stream)
+{
+    dng_image_writer writer;
+
+    {
+        // WriteDNG reuses the digest once it is computed
+        DngProfileScope scope(m_Profile, "raw digest");
+        m_Negative->FindRawImageDigest(m_Host);
+    }
+
+    DngProfileScope scope(m_Profile, "write dng");
+    writer.WriteDNG(m_Host, stream, *m_Negative.Get(), m_Thumbnail, ccJPEG, &m_PreviewList);
+}
+
+void DngConverter::WriteSequential(dng_stream& stream)
+{
+    // WriteDNG seeks back to patch offsets and links, so the file is laid
+    // out in memory and then copied out front to back
+    dng_memory_stream memoryStream(m_Allocator);
+
+    Write(memoryStream);
+
+    DngProfileScope scope(m_Profile, "stream out");
+    memoryStream.SetReadPosition(0);
+    memoryStream.CopyToStream(stream, memoryStream.Length());
+    stream.Flush();
+}
+
+void DngConverter::Write(const char* outfilename)
+{
+    if (strcmp(outfilename, "-") == 0)
+    {
+#if qWinOS
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        DngPipeStream pipeStream(stdout);
+        WriteSequential(pipeStream);
+        if (fflush(stdout) != 0)
+            ThrowWriteFile();
+        return;
+    }
+
+    dng_file_stream filestream(outfilename, true);
+
+    Write(filestream);
+}
+
+dng_memory_block* DngConverter::WriteToMemory()
+{
+    dng_memory_stream stream(m_Allocator);
+
+    Write(stream);
+
+    return stream.AsMemoryBlock(m_Allocator);
+}
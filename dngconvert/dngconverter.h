@@ -0,0 +1,145 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "dng_auto_ptr.h"
+#include "dng_date_time.h"
+#include "dng_image.h"
+#include "dng_memory.h"
+#include "dng_negative.h"
+#include "dng_preview.h"
+#include "dng_stream.h"
+#include "dng_string.h"
+
+#include "dnghost.h"
+
+class CameraProfileRegistry;
+class DngProfile;
+class LibRawImage;
+
+struct DngConvertOptions
+{
+    DngConvertOptions()
+        : deadpixelfilename(NULL),
+          profilefilename(NULL),
+          exiffilename(NULL),
+          embedOriginal(false),
+          fastPreview(false),
+          cameraPreview(false),
+          previewSizes(),
+          profileRegistry(NULL)
+    {
+    }
+
+    const char* deadpixelfilename;
+    const char* profilefilename;
+    // NULL reads exif/xmp from the raw data, "-" disables reading it
+    const char* exiffilename;
+    bool embedOriginal;
+    bool fastPreview;
+    bool cameraPreview;
+    std::vector<uint32> previewSizes;
+    // Shares parsed camera profiles between conversions and looks up
+    // profiles for cameras without -dcp. NULL parses per conversion.
+    CameraProfileRegistry* profileRegistry;
+};
+
+// DngConverter turns one raw file into a DNG. The input may be a file, a
+// dng_stream or a buffer in memory, the DNG is written to a file, a
+// caller supplied dng_stream or a memory block. A converter is used for a
+// single conversion. The XMP SDK must be initialized by the caller.
+//
+// Besides the one shot Convert() calls the phases are public so batch
+// callers can run them on different threads: an input setter, Decode(),
+// Render() and one of the Write() calls, in this order.
+
+class DngConverter
+{
+public:
+    DngConverter(const DngConvertOptions& options, dng_memory_allocator& allocator = gDefaultDNGMemoryAllocator);
+    ~DngConverter(void);
+
+    // Records the time spent in each phase to profile, which must outlive
+    // the conversion. Peak memory is known if the converter's allocator is
+    // profile's tracker.
+    void SetProfile(DngProfile* profile);
+
+    // Rough peak of the memory a conversion of filename with options takes,
+    // worked out from the TIFF header of the raw file without opening it in
+    // LibRaw. Batch callers use it to decide how many files fit in memory
+    // at once. Files that are not TIFF based are sized from their length.
+    static uint64 EstimatePeakBytes(const char* filename, const DngConvertOptions& options);
+
+    // Return false if the raw data could not be decoded, other errors
+    // are thrown as dng_exception.
+    bool Convert(const char* filename, const char* outfilename);
+    bool Convert(dng_stream& input, dng_stream& output, const char* name);
+
+    // Returns the DNG in a memory block owned by the caller, NULL if the
+    // raw data could not be decoded.
+    dng_memory_block* Convert(const void* data, uint32 size, const char* name);
+
+    // name is stored as the original raw file name and used in messages.
+    void ReadFile(const char* filename);
+    void ReadStream(dng_stream& stream, const char* name);
+    // data is not copied and must stay valid until Decode() returned.
+    void SetInput(const void* data, uint32 size, const char* name);
+    // The raw data read or set above, valid until Decode() returned.
+    const void* InputData() const { return m_RawBuffer; }
+    uint32 InputSize() const { return m_RawSize; }
+
+    bool Decode();
+    void Render();
+
+    // The output stream must be seekable, WriteDNG patches offsets.
+    void Write(dng_stream& stream);
+    // For streams that can only be appended to, like a pipe or socket. The
+    // DNG is laid out in memory first and then written front to back, the
+    // bytes are the same as from Write().
+    void WriteSequential(dng_stream& stream);
+    // outfilename "-" writes sequentially to stdout.
+    void Write(const char* outfilename);
+    dng_memory_block* WriteToMemory();
+
+private:
+    DngConvertOptions m_Options;
+    dng_memory_allocator& m_Allocator;
+    DngHost m_Host;
+    std::string m_Name;
+    AutoPtr<dng_memory_block> m_RawData;
+    const uint8* m_RawBuffer;
+    uint32 m_RawSize;
+    AutoPtr<dng_image> m_Image;
+    LibRawImage* m_RawImage;
+    AutoPtr<dng_negative> m_Negative;
+    dng_string m_AppVersion;
+    dng_date_time_info m_DateTime;
+    dng_preview_list m_PreviewList;
+    dng_image_preview m_Thumbnail;
+    DngProfile* m_Profile;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DngConverter(const DngConverter& converter);
+    DngConverter& operator=(const DngConverter& converter);
+};
@@ -144,14 +144,21 @@ int Exiv2DngStreamIO::seek(long offset, Position pos)
     return 0;
 }
 
-Exiv2::byte* Exiv2DngStreamIO::mmap(bool /*isWriteable*/)
+Exiv2::byte* Exiv2DngStreamIO::mmap(bool isWriteable)
 {
+    // memory backed streams can be handed out directly for reading
+    if (!isWriteable && m_Stream.Data() != NULL)
+        return (Exiv2::byte*)m_Stream.Data();
+
     m_MemBlock = std::auto_ptr<dng_memory_block>(m_Stream.AsMemoryBlock(m_Allocator));
     return (Exiv2::byte*)m_MemBlock.get()->Buffer();
 }
 
 int Exiv2DngStreamIO::munmap()
 {
+    if (!m_MemBlock.get())
+        return 0;
+
     m_Stream.SetReadPosition(0);
     m_Stream.SetLength(0);
     m_Stream.Put(m_MemBlock.get()->Buffer(), m_MemBlock.get()->LogicalSize());
@@ -20,6 +20,7 @@
 #include "exiv2meta.h"
 #include "exiv2dngstreamio.h"
 
+#include <dng_mutex.h>
 #include <dng_rational.h>
 #include <dng_orientation.h>
 
@@ -31,6 +32,10 @@
 #include <windows.h>
 #endif
 
+// Exiv2 initializes and tears down its XMP toolkit globally, so concurrent
+// conversions must not run their metadata parsing at the same time
+static dng_mutex gExiv2Mutex("Exiv2Meta");
+
 void printExiv2ExceptionError(const char* msg, Exiv2::Error& e)
 {
     std::string s(e.what());
@@ -183,6 +188,8 @@ Exiv2Meta::~Exiv2Meta()
 
 void Exiv2Meta::Parse(dng_host &host, dng_stream &stream)
 {
+    dng_lock_mutex lock(&gExiv2Mutex);
+
     m_Exif.Reset(new dng_exif());
 
     try
@@ -102,7 +102,7 @@ char* LibRawDngDataStream::gets(char* str, int size)
 
     int32 index = 0;
 
-    while (true)
+    while (m_Stream.Position() < m_Stream.Length())
     {
         char c = (char)m_Stream.Get_uint8();
 
@@ -23,80 +23,108 @@
 #include "dng_file_stream.h"
 #include "dng_memory.h"
 
+#include "dngprofile.h"
+
+#include "rawkernels.h"
+
 #include "libraw/libraw.h"
 
+#include <math.h>
+
 using std::min;
 using std::max;
 
-LibRawImage::LibRawImage(const char *filename, dng_memory_allocator &allocator)
+// Rows extracted at once before a rotated mosaic is transposed
+static const uint32 kCFABandRows = 64;
+
+// Pixel aspects this close to square are not stretched
+static const real64 kSquareAspectMin = 0.995;
+static const real64 kSquareAspectMax = 1.005;
+
+// adjust_sizes_info_only() leaves LibRaw in a state where unpack() fails,
+// so the final size is computed here the same way, unrotated. This is a
+// copy of adjust_sizes_info_only() from LibRaw 0.21 and has to be checked
+// against it when moving to another LibRaw release.
+class LibRawProcessor : public LibRaw
+{
+public:
+    void FinalSize(uint32 &width, uint32 &height)
+    {
+        uint32 shrink = libraw_internal_data.internal_output_params.shrink;
+        uint32 fujiWidth = libraw_internal_data.internal_output_params.fuji_width;
+
+        width = (imgdata.sizes.width + shrink) >> shrink;
+        height = (imgdata.sizes.height + shrink) >> shrink;
+
+        if (!imgdata.params.use_fuji_rotate)
+            return;
+
+        if (fujiWidth)
+        {
+            fujiWidth = (fujiWidth - 1 + shrink) >> shrink;
+            width = static_cast<ushort>(fujiWidth / sqrt(0.5));
+            height = static_cast<ushort>((static_cast<real64>(height) - fujiWidth) / sqrt(0.5));
+        }
+        else
+        {
+            if (imgdata.sizes.pixel_aspect < kSquareAspectMin)
+                height = static_cast<ushort>(height / imgdata.sizes.pixel_aspect + 0.5);
+            if (imgdata.sizes.pixel_aspect > kSquareAspectMax)
+                width = static_cast<ushort>(width * imgdata.sizes.pixel_aspect + 0.5);
+        }
+    }
+};
+
+LibRawImage::LibRawImage(const char *filename, dng_memory_allocator &allocator, bool loadEmbeddedPreview,
+                         DngProfile *profile)
     :	dng_image(dng_rect(0, 0), 0, ttShort),
       m_Allocator(allocator),
       m_Buffer(),
-      m_Memory()
+      m_Memory(),
+      m_RawProcessor(),
+      m_LoadEmbeddedPreview(loadEmbeddedPreview),
+      m_EmbeddedPreview()
 {
     dng_file_stream stream(filename);
-    Parse(stream);
+    LibRawDngDataStream rawStream(stream);
+    Parse(rawStream, profile);
 }
 
-LibRawImage::LibRawImage(dng_stream &stream, dng_memory_allocator &allocator)
+LibRawImage::LibRawImage(dng_stream &stream, dng_memory_allocator &allocator, bool loadEmbeddedPreview,
+                         DngProfile *profile)
     :	dng_image(dng_rect(0, 0), 0, ttShort),
       m_Allocator(allocator),
       m_Buffer(),
-      m_Memory()
+      m_Memory(),
+      m_RawProcessor(),
+      m_LoadEmbeddedPreview(loadEmbeddedPreview),
+      m_EmbeddedPreview()
 {
-    Parse(stream);
+    LibRawDngDataStream rawStream(stream);
+    Parse(rawStream, profile);
 }
 
-void LibRawImage::Parse(dng_stream &stream)
+LibRawImage::LibRawImage(const void *data, uint32 size, dng_memory_allocator &allocator, bool loadEmbeddedPreview,
+                         DngProfile *profile)
+    :	dng_image(dng_rect(0, 0), 0, ttShort),
+      m_Allocator(allocator),
+      m_Buffer(),
+      m_Memory(),
+      m_RawProcessor(),
+      m_LoadEmbeddedPreview(loadEmbeddedPreview),
+      m_EmbeddedPreview()
 {
-    AutoPtr<LibRawDngDataStream> rawStream(new LibRawDngDataStream(stream));
-    AutoPtr<LibRaw> rawProcessor(new LibRaw());
-
-#if (LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0,14))
-    {
-        rawProcessor->imgdata.params.user_flip = 0;
-    }
-#endif
-
-    int ret = rawProcessor->open_datastream(rawStream.Get());
-    if (ret != LIBRAW_SUCCESS)
-    {
-        printf("Cannot open stream: %s\n", libraw_strerror(ret));
-        rawProcessor->recycle();
-        return;
-    }
-
-    ret = rawProcessor->adjust_sizes_info_only();
-    if (ret != LIBRAW_SUCCESS)
-    {
-        printf("LibRaw: failed to run adjust_sizes_info_only: %s\n", libraw_strerror(ret));
-        rawProcessor->recycle();
-        return;
-    }
-
-    uint32 finalWidth = 0;
-    uint32 finalHeight = 0;
+    // LibRaw's own memory stream, the buffer is only read
+    LibRaw_buffer_datastream rawStream(const_cast<void*>(data), size);
+    Parse(rawStream, profile);
+}
 
-#if (LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0,14))
-    finalWidth = rawProcessor->imgdata.sizes.iwidth;
-    finalHeight = rawProcessor->imgdata.sizes.iheight;
-#else
-    if ((rawProcessor->imgdata.sizes.flip == 5) || (rawProcessor->imgdata.sizes.flip == 6))
-    {
-        finalHeight = rawProcessor->imgdata.sizes.iwidth;
-        finalWidth = rawProcessor->imgdata.sizes.iheight;
-    }
-    else
-    {
-        finalHeight = rawProcessor->imgdata.sizes.iheight;
-        finalWidth = rawProcessor->imgdata.sizes.iwidth;
-    }
-#endif
+void LibRawImage::Parse(LibRaw_abstract_datastream &rawStream, DngProfile *profile)
+{
+    DngProfileScope unpackScope(profile, "libraw unpack");
 
-    rawProcessor->recycle();
+    AutoPtr<LibRawProcessor> rawProcessor(new LibRawProcessor());
 
-    rawStream.Get()->seek(0, SEEK_SET);
-    
     rawProcessor->imgdata.params.output_bps = 16;
     rawProcessor->imgdata.params.document_mode = 2;
     rawProcessor->imgdata.params.shot_select = 0;
@@ -106,22 +134,43 @@ void LibRawImage::Parse(dng_stream &stream)
     }
 #endif
 
-    ret = rawProcessor->open_datastream(rawStream.Get());
+    int ret = rawProcessor->open_datastream(&rawStream);
     if (ret != LIBRAW_SUCCESS)
     {
-        printf("Cannot open stream: %s\n", libraw_strerror(ret));
+        fprintf(stderr, "Cannot open stream: %s\n", libraw_strerror(ret));
         rawProcessor->recycle();
         return;
     }
 
+    uint32 finalWidth = 0;
+    uint32 finalHeight = 0;
+    rawProcessor->FinalSize(finalWidth, finalHeight);
+
     ret = rawProcessor->unpack();
     if (ret != LIBRAW_SUCCESS)
     {
-        printf("LibRaw: failed to run unpack: %s\n", libraw_strerror(ret));
+        fprintf(stderr, "LibRaw: failed to run unpack: %s\n", libraw_strerror(ret));
         rawProcessor->recycle();
         return;
     }
 
+    if (m_LoadEmbeddedPreview)
+    {
+        // keep a copy of the camera's JPEG preview, other formats are ignored
+        ret = rawProcessor->unpack_thumb();
+        if ((ret == LIBRAW_SUCCESS) &&
+                (rawProcessor->imgdata.thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) &&
+                (rawProcessor->imgdata.thumbnail.tlength > 0))
+        {
+            m_EmbeddedPreview.Reset(m_Allocator.Allocate(rawProcessor->imgdata.thumbnail.tlength));
+            memcpy(m_EmbeddedPreview->Buffer(), rawProcessor->imgdata.thumbnail.thumb, rawProcessor->imgdata.thumbnail.tlength);
+        }
+    }
+
+    unpackScope.Stop();
+
+    DngProfileScope copyScope(profile, "libraw copy");
+
     libraw_image_sizes_t *sizes = NULL;
     libraw_iparams_t *iparams = NULL;
     libraw_colordata_t *colors = NULL;
@@ -147,7 +196,7 @@ void LibRawImage::Parse(dng_stream &stream)
         ret = rawProcessor->add_masked_borders_to_bitmap();
         if (ret != LIBRAW_SUCCESS)
         {
-            printf("LibRaw: failed to run add_masked_borders_to_bitmap: %s\n", libraw_strerror(ret));
+            fprintf(stderr, "LibRaw: failed to run add_masked_borders_to_bitmap: %s\n", libraw_strerror(ret));
             rawProcessor->recycle();
             return;
         }
@@ -208,8 +257,6 @@ void LibRawImage::Parse(dng_stream &stream)
     uint32 pixelSize = TagTypeSize(pixelType);
     uint32 bytes = fBounds.H() * fBounds.W() * fPlanes * pixelSize;
 
-    m_Memory.Reset(m_Allocator.Allocate(bytes));
-
     m_Buffer.fArea       = fBounds;
     m_Buffer.fPlane      = 0;
     m_Buffer.fPlanes     = fPlanes;
@@ -218,28 +265,58 @@ void LibRawImage::Parse(dng_stream &stream)
     m_Buffer.fPlaneStep  = 1;
     m_Buffer.fPixelType  = pixelType;
     m_Buffer.fPixelSize  = pixelSize;
-    m_Buffer.fData       = m_Memory->Buffer();
+
+    bool adoptRawImage = false;
 
 #if (LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0,14))
     libraw_decoder_info_t decoder_info;
     rawProcessor->get_decoder_info(&decoder_info);
 
+    // A flat field bayer image is used in place: the pixel buffer points
+    // into LibRaw's raw_image with a row step of raw_width, and the
+    // processor owning it lives as long as this image.
+    if ((decoder_info.decoder_flags & LIBRAW_DECODER_FLATFIELD) &&
+            (rawProcessor->imgdata.rawdata.raw_image != NULL) &&
+            (fujiRotate90 == false))
+    {
+        if (entireSensorData == true)
+            adoptRawImage = (rawWidth == sizes->raw_width) && (rawHeight == sizes->raw_height);
+        else
+            adoptRawImage = true;
+    }
+
+    if (adoptRawImage)
+    {
+        unsigned short* input = rawProcessor->imgdata.rawdata.raw_image;
+        if (entireSensorData == false)
+            input += sizes->left_margin + sizes->top_margin * sizes->raw_width;
+
+        m_Buffer.fRowStep = sizes->raw_width;
+        m_Buffer.fData    = input;
+    }
+    else
+#endif
+    {
+        m_Memory.Reset(m_Allocator.Allocate(bytes));
+        m_Buffer.fData = m_Memory->Buffer();
+    }
+
+#if (LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0,14))
+
     if (decoder_info.decoder_flags & LIBRAW_DECODER_LEGACY)
     {
-        unsigned short* output = (unsigned short*)m_Buffer.fData;
+        uint16* output = (uint16*)m_Buffer.fData;
 
         for (unsigned int row = 0; row < sizes->raw_height; row++)
         {
-            for (unsigned int col = 0; col < sizes->raw_width; col++)
-            {
-                for (uint32 color = 0; color < m_Channels; color++)
-                {
-                    *output = rawProcessor->imgdata.rawdata.color_image[row * sizes->raw_width + col][color];
-                    ++output;
-                }
-            }
+            DeinterleaveQuad(rawProcessor->imgdata.rawdata.color_image[row * sizes->raw_width],
+                             output + row * m_Buffer.fRowStep, sizes->raw_width, fPlanes);
         }
     }
+    else if (adoptRawImage)
+    {
+        // m_Buffer already points to raw_image
+    }
     else if(decoder_info.decoder_flags & LIBRAW_DECODER_FLATFIELD)
     {
         unsigned short* output = (unsigned short*)m_Buffer.fData;
@@ -252,14 +329,9 @@ void LibRawImage::Parse(dng_stream &stream)
             }
             else
             {
-                for (unsigned int col = 0; col < sizes->raw_width; col++)
-                {
-                    for (unsigned int row = 0; row < sizes->raw_height; row++)
-                    {
-                        *output = rawProcessor->imgdata.rawdata.raw_image[row * sizes->raw_width + col];
-                        ++output;
-                    }
-                }
+                TransposeShort(rawProcessor->imgdata.rawdata.raw_image, sizes->raw_width,
+                               output, m_Buffer.fRowStep,
+                               sizes->raw_height, sizes->raw_width);
             }
         }
         else
@@ -277,39 +349,30 @@ void LibRawImage::Parse(dng_stream &stream)
             }
             else
             {
-                for (unsigned int col = sizes->left_margin; col < sizes->width + sizes->left_margin; col++)
-                {
-                    for (unsigned int row = sizes->top_margin; row < sizes->height + sizes->top_margin; row++)
-                    {
-                        *output = rawProcessor->imgdata.rawdata.raw_image[row * sizes->raw_width + col];
-                        ++output;
-                    }
-                }
+                unsigned short* input = rawProcessor->imgdata.rawdata.raw_image;
+                input += sizes->left_margin + sizes->top_margin * sizes->raw_width;
+                TransposeShort(input, sizes->raw_width,
+                               output, m_Buffer.fRowStep,
+                               sizes->height, sizes->width);
             }
         }
 
     }
     else
     {
-        printf("LibRaw: unsupported decoder\n");
+        fprintf(stderr, "LibRaw: unsupported decoder\n");
         rawProcessor->recycle();
         return;
     }
 #else
     if (m_Pattern == 0)
     {
-        unsigned short* output = (unsigned short*)m_Buffer.fData;
+        uint16* output = (uint16*)m_Buffer.fData;
 
         for (unsigned int row = 0; row < sizes->iheight; row++)
         {
-            for (unsigned int col = 0; col < sizes->iwidth; col++)
-            {
-                for (uint32 color = 0; color < m_Channels; color++)
-                {
-                    *output = rawProcessor->imgdata.image[row * sizes->iwidth + col][color];
-                    ++output;
-                }
-            }
+            DeinterleaveQuad(rawProcessor->imgdata.image[row * sizes->iwidth],
+                             output + row * m_Buffer.fRowStep, sizes->iwidth, fPlanes);
         }
     }
     else
@@ -317,28 +380,43 @@ void LibRawImage::Parse(dng_stream &stream)
         if (!iparams->cdesc[3])
             iparams->cdesc[3] = 'G';
 
-        unsigned short* output = (unsigned short*)m_Buffer.fData;
+        // COLOR() repeats every 16 rows and columns, also for the
+        // rotated Fuji layout
+        uint8 colors[16][16];
+        for (uint32 row = 0; row < 16; row++)
+        {
+            for (uint32 col = 0; col < 16; col++)
+            {
+                colors[row][col] = static_cast<uint8>(rawProcessor->COLOR(row, col));
+            }
+        }
+
+        uint16* output = (uint16*)m_Buffer.fData;
 
         if (fujiRotate90 == false)
         {
             for (unsigned int row = 0; row < sizes->iheight; row++)
             {
-                for (unsigned int col = 0; col < sizes->iwidth; col++)
-                {
-                    *output = rawProcessor->imgdata.image[row * sizes->iwidth + col][rawProcessor->COLOR(row, col)];
-                    ++output;
-                }
+                ExtractCFARow(rawProcessor->imgdata.image[row * sizes->iwidth],
+                              output + row * m_Buffer.fRowStep, sizes->iwidth, colors[row & 15]);
             }
         }
         else
         {
-            for (unsigned int col = 0; col < sizes->iwidth; col++)
+            // extract a band of rows, then transpose it into place
+            AutoPtr<dng_memory_block> band(m_Allocator.Allocate(kCFABandRows * sizes->iwidth * sizeof(uint16)));
+            uint16* bandData = band->Buffer_uint16();
+
+            for (unsigned int top = 0; top < sizes->iheight; top += kCFABandRows)
             {
-                for (unsigned int row = 0; row < sizes->iheight; row++)
+                uint32 rows = Min_uint32(kCFABandRows, sizes->iheight - top);
+                for (uint32 row = 0; row < rows; row++)
                 {
-                    *output = rawProcessor->imgdata.image[row * sizes->iwidth + col][rawProcessor->COLOR(row, col)];
-                    ++output;
+                    ExtractCFARow(rawProcessor->imgdata.image[(top + row) * sizes->iwidth],
+                                  bandData + row * sizes->iwidth, sizes->iwidth, colors[(top + row) & 15]);
                 }
+
+                TransposeShort(bandData, sizes->iwidth, output + top, m_Buffer.fRowStep, rows, sizes->iwidth);
             }
         }
     }
@@ -434,7 +512,7 @@ void LibRawImage::Parse(dng_stream &stream)
         camXYZ[2][2] = colors->cam_xyz[2][2];
         if (camXYZ.MaxEntry() == 0.0)
         {
-            printf("Warning, camera XYZ Matrix is null\n");
+            fprintf(stderr, "Warning, camera XYZ Matrix is null\n");
             camXYZ = dng_matrix_3by3(1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0);
         }
 
@@ -459,7 +537,7 @@ void LibRawImage::Parse(dng_stream &stream)
         camXYZ[3][2] = colors->cam_xyz[3][2];
         if (camXYZ.MaxEntry() == 0.0)
         {
-            printf("Warning, camera XYZ Matrix is null\n");
+            fprintf(stderr, "Warning, camera XYZ Matrix is null\n");
             camXYZ = dng_matrix_4by3(0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 1.0);
         }
 
@@ -469,7 +547,10 @@ void LibRawImage::Parse(dng_stream &stream)
     }
     }
 
-    rawProcessor->recycle();
+    if (adoptRawImage)
+        m_RawProcessor.Reset(rawProcessor.Release());
+    else
+        rawProcessor->recycle();
 }
 
 LibRawImage::LibRawImage(const dng_rect &bounds,
@@ -479,7 +560,10 @@ LibRawImage::LibRawImage(const dng_rect &bounds,
     : dng_image(bounds, planes, pixelType),
       m_Allocator(allocator),
       m_Buffer(),
-      m_Memory()
+      m_Memory(),
+      m_RawProcessor(),
+      m_LoadEmbeddedPreview(false),
+      m_EmbeddedPreview()
 {
     uint32 pixelSize = TagTypeSize(pixelType);
 
@@ -632,3 +716,8 @@ ColorKeyCode LibRawImage::ColorKey(uint32 plane) const
     }
     return colorKeyMaxEnum;
 }
+
+const dng_memory_block* LibRawImage::EmbeddedPreview() const
+{
+    return m_EmbeddedPreview.Get();
+}
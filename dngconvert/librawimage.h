@@ -30,12 +30,21 @@
 
 #include "libraw/libraw_types.h"
 
+class DngProfile;
+class LibRawProcessor;
+class LibRaw_abstract_datastream;
+
 class LibRawImage :
         public dng_image
 {
 public:
-    LibRawImage(const char *filename, dng_memory_allocator &allocator);
-    LibRawImage(dng_stream &stream, dng_memory_allocator &allocator);
+    LibRawImage(const char *filename, dng_memory_allocator &allocator, bool loadEmbeddedPreview = false,
+                DngProfile *profile = NULL);
+    LibRawImage(dng_stream &stream, dng_memory_allocator &allocator, bool loadEmbeddedPreview = false,
+                DngProfile *profile = NULL);
+    // data is only read while constructing and may be freed afterwards
+    LibRawImage(const void *data, uint32 size, dng_memory_allocator &allocator, bool loadEmbeddedPreview = false,
+                DngProfile *profile = NULL);
     LibRawImage(const dng_rect &bounds, uint32 planes, uint32 pixelType, dng_memory_allocator &allocator);
     ~LibRawImage(void);
 
@@ -58,17 +67,20 @@ public:
     const dng_orientation Orientation() const;
     uint32 Pattern() const;
     ColorKeyCode ColorKey(uint32 plane) const;
+    const dng_memory_block* EmbeddedPreview() const;
 
 protected:
     virtual void AcquireTileBuffer(dng_tile_buffer &buffer, const dng_rect &area, bool dirty) const;
 
 private:
-    void Parse(dng_stream &stream);
+    void Parse(LibRaw_abstract_datastream &rawStream, DngProfile *profile);
 
 protected:
     dng_memory_allocator &m_Allocator;
     dng_pixel_buffer m_Buffer;
     AutoPtr<dng_memory_block> m_Memory;
+    // Owns the raw data m_Buffer points to if it was not copied
+    AutoPtr<LibRawProcessor> m_RawProcessor;
     dng_rect m_ActiveArea;
     dng_vector m_CameraNeutral;
     dng_string m_ModelName;
@@ -86,4 +98,6 @@ protected:
     dng_orientation m_BaseOrientation;
     uint32 m_Pattern;
     ColorKeyCode m_CFAPlaneColor[4];
+    bool m_LoadEmbeddedPreview;
+    AutoPtr<dng_memory_block> m_EmbeddedPreview;
 };
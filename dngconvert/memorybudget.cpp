@@ -0,0 +1,81 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "memorybudget.h"
+
+MemoryBudget::MemoryBudget(uint64 bytes, uint32 maxRunning)
+    : m_Mutex("MemoryBudget"),
+      m_Released(),
+      m_Bytes(bytes),
+      m_MaxRunning(maxRunning),
+      m_Reserved(0),
+      m_PeakReserved(0),
+      m_Running(0)
+{
+}
+
+size_t MemoryBudget::Acquire(const std::vector<uint64> &sizes)
+{
+    dng_lock_mutex lock(&m_Mutex);
+
+    while (true)
+    {
+        if ((m_MaxRunning == 0) || (m_Running < m_MaxRunning))
+        {
+            size_t index = sizes.size();
+            for (size_t i = 0; i < sizes.size(); i++)
+            {
+                if (m_Reserved + sizes[i] <= m_Bytes)
+                {
+                    index = i;
+                    break;
+                }
+            }
+
+            // nothing fits, the first file gets the budget to itself
+            if ((index == sizes.size()) && (m_Running == 0) && !sizes.empty())
+                index = 0;
+
+            if (index < sizes.size())
+            {
+                m_Reserved += sizes[index];
+                if (m_Reserved > m_PeakReserved)
+                    m_PeakReserved = m_Reserved;
+                m_Running++;
+                return index;
+            }
+        }
+
+        m_Released.Wait(m_Mutex);
+    }
+}
+
+void MemoryBudget::Release(uint64 bytes)
+{
+    dng_lock_mutex lock(&m_Mutex);
+    m_Reserved -= bytes;
+    m_Running--;
+    m_Released.Broadcast();
+}
+
+uint64 MemoryBudget::PeakReserved()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_PeakReserved;
+}
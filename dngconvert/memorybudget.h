@@ -0,0 +1,62 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <vector>
+
+#include "dng_mutex.h"
+#include "dng_types.h"
+
+// Admission control for batch conversions. Each file reserves its
+// estimated peak memory before it is started and gives it back when it is
+// done, so files only run at once while their estimates fit in the budget.
+// A file larger than the whole budget runs once nothing else does.
+
+class MemoryBudget
+{
+public:
+    // maxRunning limits the files holding a reservation at once, 0 only
+    // limits the bytes.
+    MemoryBudget(uint64 bytes, uint32 maxRunning);
+
+    // Blocks until one of sizes fits next to the running files, reserves
+    // it and returns its index. The first one that fits is taken, so
+    // smaller files go ahead of a large one that has to wait.
+    size_t Acquire(const std::vector<uint64> &sizes);
+
+    void Release(uint64 bytes);
+
+    // Highest total reserved at once.
+    uint64 PeakReserved();
+
+private:
+    dng_mutex m_Mutex;
+    dng_condition m_Released;
+    uint64 m_Bytes;
+    uint32 m_MaxRunning;
+    uint64 m_Reserved;
+    uint64 m_PeakReserved;
+    uint32 m_Running;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    MemoryBudget(const MemoryBudget &budget);
+    MemoryBudget& operator=(const MemoryBudget &budget);
+};
@@ -0,0 +1,405 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+   
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public   
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "rawkernels.h"
+
+#include <string.h>
+
+#include "dng_assertions.h"
+#include "dng_utils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define qRawSSE2 1
+#include <emmintrin.h>
+#else
+#define qRawSSE2 0
+#endif
+
+// GCC 4.9 and clang compile single functions for SSSE3 and AVX2 without
+// the -m flags, those are only used if the processor has them
+#if qRawSSE2 && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define qRawDispatch 1
+#define RAW_TARGET(name) __attribute__((target(name)))
+#else
+#define qRawDispatch 0
+#define RAW_TARGET(name)
+#endif
+
+#if qRawDispatch || defined(__SSSE3__) || defined(__AVX__)
+#define qRawSSSE3 1
+#include <tmmintrin.h>
+#else
+#define qRawSSSE3 0
+#endif
+
+#if qRawDispatch || defined(__AVX2__)
+#define qRawAVX2 1
+#include <immintrin.h>
+#else
+#define qRawAVX2 0
+#endif
+
+#if qRawSSSE3
+static bool hasSSSE3()
+{
+#if defined(__SSSE3__) || defined(__AVX__)
+    return true;
+#else
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+#endif
+}
+#endif
+
+#if qRawAVX2
+static bool hasAVX2()
+{
+#if defined(__AVX2__)
+    return true;
+#else
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+#endif
+}
+#endif
+
+// 64 x 64 samples of source and destination fit into L1 together
+static const uint32 kTransposeTile = 64;
+
+#if qRawSSE2
+
+static inline void transpose8x8(const uint16 *src, uint32 srcRowStep, uint16 *dst, uint32 dstRowStep)
+{
+    __m128i r0 = _mm_loadu_si128((const __m128i*) (src + 0 * srcRowStep));
+    __m128i r1 = _mm_loadu_si128((const __m128i*) (src + 1 * srcRowStep));
+    __m128i r2 = _mm_loadu_si128((const __m128i*) (src + 2 * srcRowStep));
+    __m128i r3 = _mm_loadu_si128((const __m128i*) (src + 3 * srcRowStep));
+    __m128i r4 = _mm_loadu_si128((const __m128i*) (src + 4 * srcRowStep));
+    __m128i r5 = _mm_loadu_si128((const __m128i*) (src + 5 * srcRowStep));
+    __m128i r6 = _mm_loadu_si128((const __m128i*) (src + 6 * srcRowStep));
+    __m128i r7 = _mm_loadu_si128((const __m128i*) (src + 7 * srcRowStep));
+
+    __m128i t0 = _mm_unpacklo_epi16(r0, r1);
+    __m128i t1 = _mm_unpackhi_epi16(r0, r1);
+    __m128i t2 = _mm_unpacklo_epi16(r2, r3);
+    __m128i t3 = _mm_unpackhi_epi16(r2, r3);
+    __m128i t4 = _mm_unpacklo_epi16(r4, r5);
+    __m128i t5 = _mm_unpackhi_epi16(r4, r5);
+    __m128i t6 = _mm_unpacklo_epi16(r6, r7);
+    __m128i t7 = _mm_unpackhi_epi16(r6, r7);
+
+    __m128i u0 = _mm_unpacklo_epi32(t0, t2);
+    __m128i u1 = _mm_unpackhi_epi32(t0, t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1, t3);
+    __m128i u3 = _mm_unpackhi_epi32(t1, t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4, t6);
+    __m128i u5 = _mm_unpackhi_epi32(t4, t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5, t7);
+    __m128i u7 = _mm_unpackhi_epi32(t5, t7);
+
+    _mm_storeu_si128((__m128i*) (dst + 0 * dstRowStep), _mm_unpacklo_epi64(u0, u4));
+    _mm_storeu_si128((__m128i*) (dst + 1 * dstRowStep), _mm_unpackhi_epi64(u0, u4));
+    _mm_storeu_si128((__m128i*) (dst + 2 * dstRowStep), _mm_unpacklo_epi64(u1, u5));
+    _mm_storeu_si128((__m128i*) (dst + 3 * dstRowStep), _mm_unpackhi_epi64(u1, u5));
+    _mm_storeu_si128((__m128i*) (dst + 4 * dstRowStep), _mm_unpacklo_epi64(u2, u6));
+    _mm_storeu_si128((__m128i*) (dst + 5 * dstRowStep), _mm_unpackhi_epi64(u2, u6));
+    _mm_storeu_si128((__m128i*) (dst + 6 * dstRowStep), _mm_unpacklo_epi64(u3, u7));
+    _mm_storeu_si128((__m128i*) (dst + 7 * dstRowStep), _mm_unpackhi_epi64(u3, u7));
+}
+
+#endif
+
+#if qRawAVX2
+
+// Same as transpose8x8 on two 8 x 8 blocks side by side, one per lane
+RAW_TARGET("avx2") static inline void transpose8x16(const uint16 *src, uint32 srcRowStep, uint16 *dst, uint32 dstRowStep)
+{
+    __m256i r0 = _mm256_loadu_si256((const __m256i*) (src + 0 * srcRowStep));
+    __m256i r1 = _mm256_loadu_si256((const __m256i*) (src + 1 * srcRowStep));
+    __m256i r2 = _mm256_loadu_si256((const __m256i*) (src + 2 * srcRowStep));
+    __m256i r3 = _mm256_loadu_si256((const __m256i*) (src + 3 * srcRowStep));
+    __m256i r4 = _mm256_loadu_si256((const __m256i*) (src + 4 * srcRowStep));
+    __m256i r5 = _mm256_loadu_si256((const __m256i*) (src + 5 * srcRowStep));
+    __m256i r6 = _mm256_loadu_si256((const __m256i*) (src + 6 * srcRowStep));
+    __m256i r7 = _mm256_loadu_si256((const __m256i*) (src + 7 * srcRowStep));
+
+    __m256i t0 = _mm256_unpacklo_epi16(r0, r1);
+    __m256i t1 = _mm256_unpackhi_epi16(r0, r1);
+    __m256i t2 = _mm256_unpacklo_epi16(r2, r3);
+    __m256i t3 = _mm256_unpackhi_epi16(r2, r3);
+    __m256i t4 = _mm256_unpacklo_epi16(r4, r5);
+    __m256i t5 = _mm256_unpackhi_epi16(r4, r5);
+    __m256i t6 = _mm256_unpacklo_epi16(r6, r7);
+    __m256i t7 = _mm256_unpackhi_epi16(r6, r7);
+
+    __m256i u0 = _mm256_unpacklo_epi32(t0, t2);
+    __m256i u1 = _mm256_unpackhi_epi32(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi32(t1, t3);
+    __m256i u3 = _mm256_unpackhi_epi32(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi32(t4, t6);
+    __m256i u5 = _mm256_unpackhi_epi32(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi32(t5, t7);
+    __m256i u7 = _mm256_unpackhi_epi32(t5, t7);
+
+    __m256i c[8];
+    c[0] = _mm256_unpacklo_epi64(u0, u4);
+    c[1] = _mm256_unpackhi_epi64(u0, u4);
+    c[2] = _mm256_unpacklo_epi64(u1, u5);
+    c[3] = _mm256_unpackhi_epi64(u1, u5);
+    c[4] = _mm256_unpacklo_epi64(u2, u6);
+    c[5] = _mm256_unpackhi_epi64(u2, u6);
+    c[6] = _mm256_unpacklo_epi64(u3, u7);
+    c[7] = _mm256_unpackhi_epi64(u3, u7);
+
+    for (uint32 i = 0; i < 8; i++)
+    {
+        _mm_storeu_si128((__m128i*) (dst + i * dstRowStep), _mm256_castsi256_si128(c[i]));
+        _mm_storeu_si128((__m128i*) (dst + (i + 8) * dstRowStep), _mm256_extracti128_si256(c[i], 1));
+    }
+}
+
+// Transposes the whole 16 column blocks of 8 rows, returns the columns done
+RAW_TARGET("avx2") static uint32 transposeColumns16(const uint16 *src, uint32 srcRowStep,
+                                                    uint16 *dst, uint32 dstRowStep, uint32 cols)
+{
+    uint32 col = 0;
+    for (; col + 16 <= cols; col += 16)
+    {
+        transpose8x16(src + col, srcRowStep, dst + col * dstRowStep, dstRowStep);
+    }
+    return col;
+}
+
+#endif
+
+static void transposeTile(const uint16 *src, uint32 srcRowStep,
+                          uint16 *dst, uint32 dstRowStep,
+                          uint32 rows, uint32 cols, bool avx2)
+{
+    uint32 row = 0;
+
+#if qRawSSE2
+    for (; row + 8 <= rows; row += 8)
+    {
+        const uint16 *s = src + row * srcRowStep;
+        uint16 *d = dst + row;
+        uint32 col = 0;
+
+#if qRawAVX2
+        if (avx2)
+            col = transposeColumns16(s, srcRowStep, d, dstRowStep, cols);
+#endif
+
+        for (; col + 8 <= cols; col += 8)
+        {
+            transpose8x8(s + col, srcRowStep, d + col * dstRowStep, dstRowStep);
+        }
+
+        for (; col < cols; col++)
+        {
+            for (uint32 i = 0; i < 8; i++)
+            {
+                d[col * dstRowStep + i] = s[i * srcRowStep + col];
+            }
+        }
+    }
+#endif
+
+    (void) avx2;
+
+    for (; row < rows; row++)
+    {
+        const uint16 *s = src + row * srcRowStep;
+        for (uint32 col = 0; col < cols; col++)
+        {
+            dst[col * dstRowStep + row] = s[col];
+        }
+    }
+}
+
+void TransposeShort(const uint16 *src, uint32 srcRowStep,
+                    uint16 *dst, uint32 dstRowStep,
+                    uint32 rows, uint32 cols)
+{
+#if qRawAVX2
+    bool avx2 = hasAVX2();
+#else
+    bool avx2 = false;
+#endif
+
+    for (uint32 tileRow = 0; tileRow < rows; tileRow += kTransposeTile)
+    {
+        uint32 tileRows = Min_uint32(kTransposeTile, rows - tileRow);
+
+        for (uint32 tileCol = 0; tileCol < cols; tileCol += kTransposeTile)
+        {
+            uint32 tileCols = Min_uint32(kTransposeTile, cols - tileCol);
+
+            transposeTile(src + (size_t) tileRow * srcRowStep + tileCol, srcRowStep,
+                          dst + (size_t) tileCol * dstRowStep + tileRow, dstRowStep,
+                          tileRows, tileCols, avx2);
+        }
+    }
+}
+
+void DeinterleaveQuad(const uint16 *src, uint16 *dst, uint32 count, uint32 planes)
+{
+    DNG_ASSERT(planes >= 1 && planes <= 4, "Bad plane count");
+
+    if (planes == 4)
+    {
+        memcpy(dst, src, (size_t) count * 4 * sizeof(uint16));
+        return;
+    }
+
+    uint32 i = 0;
+
+#if qRawSSE2
+    // Each pixel is stored with all four samples, the surplus ones are
+    // overwritten by the next pixels. The last ones are left to the plain
+    // loop so nothing is written past the end of dst.
+    uint32 tail = (4 + planes - 1) / planes;
+    for (; i + 1 + tail <= count; i += 2)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*) (src + i * 4));
+        _mm_storel_epi64((__m128i*) (dst + i * planes), pixels);
+        _mm_storel_epi64((__m128i*) (dst + (i + 1) * planes), _mm_srli_si128(pixels, 8));
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        for (uint32 plane = 0; plane < planes; plane++)
+        {
+            dst[i * planes + plane] = src[i * 4 + plane];
+        }
+    }
+}
+
+#if qRawSSSE3
+
+// Rows of a bayer pattern repeat every two columns, that can be done with
+// byte shuffles. The mask for pixel pair k moves the two picked samples to
+// bytes 4k to 4k + 3.
+RAW_TARGET("ssse3") static void pairMasks(const uint8 colors[16], __m128i mask[4])
+{
+    char bytes[4][16];
+    memset(bytes, -128, sizeof(bytes));
+    for (uint32 k = 0; k < 4; k++)
+    {
+        bytes[k][4 * k + 0] = (char) (2 * colors[0]);
+        bytes[k][4 * k + 1] = (char) (2 * colors[0] + 1);
+        bytes[k][4 * k + 2] = (char) (8 + 2 * colors[1]);
+        bytes[k][4 * k + 3] = (char) (8 + 2 * colors[1] + 1);
+    }
+
+    for (uint32 k = 0; k < 4; k++)
+    {
+        mask[k] = _mm_loadu_si128((const __m128i*) bytes[k]);
+    }
+}
+
+// Extracts the whole blocks of 8 pixels from col on, returns the columns done
+RAW_TARGET("ssse3") static uint32 extractPairsSSSE3(const uint16 *src, uint16 *dst, uint32 col, uint32 count,
+                                                    const uint8 colors[16])
+{
+    __m128i mask[4];
+    pairMasks(colors, mask);
+
+    for (; col + 8 <= count; col += 8)
+    {
+        const __m128i *s = (const __m128i*) (src + col * 4);
+        __m128i v = _mm_or_si128(
+                    _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128(s + 0), mask[0]),
+                                 _mm_shuffle_epi8(_mm_loadu_si128(s + 1), mask[1])),
+                    _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128(s + 2), mask[2]),
+                                 _mm_shuffle_epi8(_mm_loadu_si128(s + 3), mask[3])));
+        _mm_storeu_si128((__m128i*) (dst + col), v);
+    }
+
+    return col;
+}
+
+#endif
+
+#if qRawAVX2
+
+// Lane 0 collects pixels 0, 1, 4, 5, 8, 9, 12, 13 and lane 1 the others,
+// the final permute puts them in order
+RAW_TARGET("avx2") static uint32 extractPairsAVX2(const uint16 *src, uint16 *dst, uint32 count,
+                                                  const uint8 colors[16])
+{
+    __m128i mask[4];
+    pairMasks(colors, mask);
+
+    __m256i wideMask[4];
+    for (uint32 k = 0; k < 4; k++)
+    {
+        wideMask[k] = _mm256_broadcastsi128_si256(mask[k]);
+    }
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    uint32 col = 0;
+    for (; col + 16 <= count; col += 16)
+    {
+        const __m256i *s = (const __m256i*) (src + col * 4);
+        __m256i v = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_shuffle_epi8(_mm256_loadu_si256(s + 0), wideMask[0]),
+                                    _mm256_shuffle_epi8(_mm256_loadu_si256(s + 1), wideMask[1])),
+                    _mm256_or_si256(_mm256_shuffle_epi8(_mm256_loadu_si256(s + 2), wideMask[2]),
+                                    _mm256_shuffle_epi8(_mm256_loadu_si256(s + 3), wideMask[3])));
+        _mm256_storeu_si256((__m256i*) (dst + col), _mm256_permutevar8x32_epi32(v, order));
+    }
+
+    return extractPairsSSSE3(src, dst, col, count, colors);
+}
+
+#endif
+
+void ExtractCFARow(const uint16 *src, uint16 *dst, uint32 count, const uint8 colors[16])
+{
+    uint32 col = 0;
+
+#if qRawSSSE3
+    bool pairs = true;
+    for (uint32 i = 2; i < 16; i++)
+    {
+        pairs = pairs && (colors[i] == colors[i & 1]);
+    }
+
+#if qRawAVX2
+    if (pairs && hasAVX2())
+    {
+        col = extractPairsAVX2(src, dst, count, colors);
+        pairs = false;
+    }
+#endif
+
+    if (pairs && hasSSSE3())
+    {
+        col = extractPairsSSSE3(src, dst, 0, count, colors);
+    }
+#endif
+
+    for (; col < count; col++)
+    {
+        dst[col] = src[col * 4 + colors[col & 15]];
+    }
+}
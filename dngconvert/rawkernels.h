@@ -0,0 +1,42 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+   
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public   
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+   
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+   
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include "dng_types.h"
+
+// Copy kernels used to move LibRaw's data into a dng_pixel_buffer. Steps
+// are counted in samples. Vectorized with SSE2 when the compiler targets
+// it, plain C++ otherwise. On x86 with GCC or clang the SSSE3 and AVX2
+// versions are built as well and picked when the processor has them.
+
+// dst[col * dstRowStep + row] = src[row * srcRowStep + col] for a rows x
+// cols source. Works in cache sized tiles.
+void TransposeShort(const uint16 *src, uint32 srcRowStep,
+                    uint16 *dst, uint32 dstRowStep,
+                    uint32 rows, uint32 cols);
+
+// Copies the first planes (at most 4) samples of count pixels stored with
+// four samples each into pixels of planes samples.
+void DeinterleaveQuad(const uint16 *src, uint16 *dst, uint32 count, uint32 planes);
+
+// Picks one sample out of each four sample pixel of a mosaic row,
+// dst[col] = src[col * 4 + colors[col & 15]]. src must start at a column
+// that is a multiple of 16 of the pattern.
+void ExtractCFARow(const uint16 *src, uint16 *dst, uint32 count, const uint8 colors[16]);
@@ -0,0 +1,199 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+// Compares LibRaw_buffer_datastream with the LibRawDngDataStream adapter it
+// replaced for decoding from memory. Each raw file given is read into
+// memory and opened and unpacked by LibRaw through both streams; without
+// files, or in addition, the stream calls LibRaw makes most are timed on
+// a synthetic buffer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "libraw/libraw.h"
+
+#include "dng_auto_ptr.h"
+#include "dng_exceptions.h"
+#include "dng_file_stream.h"
+#include "dng_memory.h"
+#include "dng_stream.h"
+#include "dng_utils.h"
+
+#include "librawdngdatastream.h"
+
+// Buffer the stream calls are timed on
+static const size_t kSyntheticBytes = 20 * 1024 * 1024;
+
+// read, seek and tell rounds like LibRaw's header parsers make
+static const uint32 kSeekRounds = 200000;
+
+static uint32 gChecksum = 0;
+
+static real64 timeGetChar(LibRaw_abstract_datastream& stream, size_t count)
+{
+    real64 start = TickTimeInSeconds();
+
+    stream.seek(0, SEEK_SET);
+    for (size_t i = 0; i < count; i++)
+        gChecksum += static_cast<uint32>(stream.get_char());
+
+    return TickTimeInSeconds() - start;
+}
+
+static real64 timeReadSeek(LibRaw_abstract_datastream& stream)
+{
+    real64 start = TickTimeInSeconds();
+
+    char buffer[16];
+    stream.seek(0, SEEK_SET);
+    for (uint32 i = 0; i < kSeekRounds; i++)
+    {
+        stream.read(buffer, 1, sizeof(buffer));
+        gChecksum += static_cast<uint32>(buffer[3]);
+        stream.seek(-8, SEEK_CUR);
+        gChecksum += static_cast<uint32>(stream.tell());
+    }
+
+    return TickTimeInSeconds() - start;
+}
+
+// Returns a negative time if LibRaw can not decode the data
+static real64 timeUnpack(LibRaw_abstract_datastream& stream)
+{
+    real64 start = TickTimeInSeconds();
+
+    AutoPtr<LibRaw> rawProcessor(new LibRaw());
+    if ((rawProcessor->open_datastream(&stream) != LIBRAW_SUCCESS) || (rawProcessor->unpack() != LIBRAW_SUCCESS))
+        return -1.0;
+    rawProcessor->recycle();
+
+    return TickTimeInSeconds() - start;
+}
+
+static void benchSynthetic()
+{
+    std::vector<uint8> data(kSyntheticBytes);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<uint8>(i * 7);
+
+    LibRaw_buffer_datastream memoryStream(&data[0], data.size());
+    dng_stream dngStream(&data[0], static_cast<uint32>(data.size()));
+    LibRawDngDataStream adapterStream(dngStream);
+
+    printf("synthetic %u MB\n", static_cast<uint32>(kSyntheticBytes >> 20));
+    printf("  get_char   memory %.3f s   adapter %.3f s\n",
+           timeGetChar(memoryStream, data.size()), timeGetChar(adapterStream, data.size()));
+    printf("  read/seek  memory %.3f s   adapter %.3f s\n",
+           timeReadSeek(memoryStream), timeReadSeek(adapterStream));
+}
+
+static bool benchFile(const char* filename, uint32 repeat)
+{
+    AutoPtr<dng_memory_block> data;
+    try
+    {
+        dng_file_stream fileStream(filename);
+        data.Reset(fileStream.AsMemoryBlock(gDefaultDNGMemoryAllocator));
+    }
+    catch (const dng_exception&)
+    {
+        fprintf(stderr, "%s: could not read file\n", filename);
+        return false;
+    }
+
+    real64 memoryTime = 0.0;
+    real64 adapterTime = 0.0;
+    for (uint32 i = 0; i < repeat; i++)
+    {
+        LibRaw_buffer_datastream memoryStream(data->Buffer(), data->LogicalSize());
+        real64 memorySeconds = timeUnpack(memoryStream);
+
+        dng_stream dngStream(data->Buffer(), data->LogicalSize());
+        LibRawDngDataStream adapterStream(dngStream);
+        real64 adapterSeconds = timeUnpack(adapterStream);
+
+        if ((memorySeconds < 0.0) || (adapterSeconds < 0.0))
+        {
+            fprintf(stderr, "%s: LibRaw could not unpack the file\n", filename);
+            return false;
+        }
+
+        memoryTime += memorySeconds;
+        adapterTime += adapterSeconds;
+    }
+
+    printf("%s\n", filename);
+    printf("  unpack     memory %.3f s   adapter %.3f s   (mean of %u)\n",
+           memoryTime / repeat, adapterTime / repeat, repeat);
+    return true;
+}
+
+int main(int argc, const char* argv [])
+{
+    uint32 repeat = 3;
+    bool synthetic = (argc == 1);
+
+    int32 index;
+    for (index = 1; index < argc && argv[index][0] == '-'; index++)
+    {
+        std::string option = &argv[index][1];
+
+        if (0 == strcmp(option.c_str(), "h"))
+        {
+            fprintf(stderr,
+                    "\n"
+                    "rawstreambench - LibRaw datastream benchmark\n"
+                    "Usage: %s [options] [<rawfile>...]\n"
+                    "Valid options:\n"
+                    "  -n <count>    unpack each file <count> times, default 3\n"
+                    "  -s            time the stream calls on a synthetic buffer too\n",
+                    argv[0]);
+            return -1;
+        }
+
+        if ((0 == strcmp(option.c_str(), "n")) && (index + 1 < argc))
+        {
+            repeat = Max_uint32(1, static_cast<uint32>(atoi(argv[++index])));
+        }
+
+        if (0 == strcmp(option.c_str(), "s"))
+        {
+            synthetic = true;
+        }
+    }
+
+    if (synthetic)
+        benchSynthetic();
+
+    int result = 0;
+    for (; index < argc; index++)
+    {
+        if (!benchFile(argv[index], repeat))
+            result = 1;
+    }
+
+    // keeps the timed loops from being optimized away
+    if (gChecksum == 1)
+        printf("\n");
+
+    return result;
+}
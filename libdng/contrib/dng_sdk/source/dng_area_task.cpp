@@ -16,12 +16,59 @@
 #include "dng_area_task.h"
 
 #include "dng_abort_sniffer.h"
+#include "dng_exceptions.h"
 #include "dng_sdk_limits.h"
 #include "dng_tile_iterator.h"
 #include "dng_utils.h"
 
 /*****************************************************************************/
 
+dng_thread_buffers::dng_thread_buffers ()
+
+	:	fBuffers (NULL)
+	,	fCount   (0)
+	
+	{
+	
+	}
+
+/*****************************************************************************/
+
+dng_thread_buffers::~dng_thread_buffers ()
+	{
+	
+	delete [] fBuffers;
+	
+	}
+
+/*****************************************************************************/
+
+void dng_thread_buffers::Reset (uint32 threadCount)
+	{
+	
+	delete [] fBuffers;
+	
+	fBuffers = NULL;
+	fCount   = 0;
+	
+	if (threadCount)
+		{
+		
+		fBuffers = new AutoPtr<dng_memory_block> [threadCount];
+		
+		if (!fBuffers)
+			{
+			ThrowMemoryFull ();
+			}
+			
+		fCount = threadCount;
+		
+		}
+	
+	}
+
+/*****************************************************************************/
+
 dng_area_task::dng_area_task ()
 
 	:	fMaxThreads   (kMaxMPThreads)
@@ -22,7 +22,10 @@
 
 /*****************************************************************************/
 
+#include "dng_assertions.h"
+#include "dng_auto_ptr.h"
 #include "dng_classes.h"
+#include "dng_memory.h"
 #include "dng_point.h"
 #include "dng_types.h"
 
@@ -193,6 +196,46 @@ class dng_area_task
 
 /*****************************************************************************/
 
+/// \brief Memory blocks indexed by the thread index of a dng_area_task.
+/// The task sizes the array in its Start method, so the number of threads is not limited at compile time.
+
+class dng_thread_buffers
+	{
+	
+	private:
+	
+		AutoPtr<dng_memory_block> *fBuffers;
+		
+		uint32 fCount;
+		
+	public:
+	
+		dng_thread_buffers ();
+		
+		~dng_thread_buffers ();
+		
+		/// Frees all blocks and makes room for threadCount empty ones.
+		
+		void Reset (uint32 threadCount);
+		
+		AutoPtr<dng_memory_block> & operator[] (uint32 threadIndex)
+			{
+			DNG_ASSERT (threadIndex < fCount, "threadIndex out of range");
+			return fBuffers [threadIndex];
+			}
+		
+	private:
+	
+		// Hidden copy constructor and assignment operator.
+		
+		dng_thread_buffers (const dng_thread_buffers &buffers);
+		
+		dng_thread_buffers & operator= (const dng_thread_buffers &buffers);
+		
+	};
+
+/*****************************************************************************/
+
 #endif
 	
 /*****************************************************************************/
@@ -75,6 +75,9 @@ void dng_filter_task::Start (uint32 threadCount,
 						   dstPixelSize *
 						   fDstPlanes;
 						   
+	fSrcBuffer.Reset (threadCount);
+	fDstBuffer.Reset (threadCount);
+	
 	for (uint32 threadIndex = 0; threadIndex < threadCount; threadIndex++)
 		{
 		
@@ -51,8 +51,8 @@ class dng_filter_task: public dng_area_task
 		
 		dng_point fSrcRepeat;
 		
-		AutoPtr<dng_memory_block> fSrcBuffer [kMaxMPThreads];
-		AutoPtr<dng_memory_block> fDstBuffer [kMaxMPThreads];
+		dng_thread_buffers fSrcBuffer;
+		dng_thread_buffers fDstBuffer;
 		
 	public:
 	
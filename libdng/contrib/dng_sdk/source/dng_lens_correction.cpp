@@ -2286,6 +2286,8 @@ void dng_opcode_FixVignetteRadial::Prepare (dng_negative &negative,
 								  pixelSize *
 								  imagePlanes;
 								   
+		fMaskBuffers.Reset (threadCount);
+		
 		for (uint32 threadIndex = 0; threadIndex < threadCount; threadIndex++)
 			{
 				
@@ -19,6 +19,7 @@
 /*****************************************************************************/
 
 #include "dng_1d_function.h"
+#include "dng_area_task.h"
 #include "dng_matrix.h"
 #include "dng_opcodes.h"
 #include "dng_pixel_buffer.h"
@@ -554,7 +555,7 @@ class dng_opcode_FixVignetteRadial: public dng_inplace_opcode
 		
 		AutoPtr<dng_memory_block> fGainTable;
 
-		AutoPtr<dng_memory_block> fMaskBuffers [kMaxMPThreads];
+		dng_thread_buffers fMaskBuffers;
 
 	public:
 	
@@ -424,7 +424,7 @@ class dng_inplace_opcode_task: public dng_area_task
 		
 		uint32 fPixelType;
 		
-		AutoPtr<dng_memory_block> fBuffer [kMaxMPThreads];
+		dng_thread_buffers fBuffer;
 
 	public:
 	
@@ -456,6 +456,8 @@ class dng_inplace_opcode_task: public dng_area_task
 								pixelSize *
 								fImage.Planes ();
 								   
+			fBuffer.Reset (threadCount);
+			
 			for (uint32 threadIndex = 0; threadIndex < threadCount; threadIndex++)
 				{
 				
@@ -725,7 +725,7 @@ class dng_render_task: public dng_filter_task
 		
 		dng_1d_table fEncodeGamma;
 	
-		AutoPtr<dng_memory_block> fTempBuffer [kMaxMPThreads];
+		dng_thread_buffers fTempBuffer;
 		
 	public:
 	
@@ -928,6 +928,8 @@ void dng_render_task::Start (uint32 threadCount,
 							
 	uint32 tempBufferSize = tileSize.h * sizeof (real32) * 3;
 	
+	fTempBuffer.Reset (threadCount);
+	
 	for (uint32 threadIndex = 0; threadIndex < threadCount; threadIndex++)
 		{
 		
@@ -453,7 +453,7 @@ class dng_resample_task: public dng_filter_task
 		
 		dng_point fSrcTileSize;
 		
-		AutoPtr<dng_memory_block> fTempBuffer [kMaxMPThreads];
+		dng_thread_buffers fTempBuffer;
 		
 	public:
 	
@@ -607,6 +607,8 @@ void dng_resample_task::Start (uint32 threadCount,
 	
 	uint32 tempBufferSize = RoundUp8 (fSrcTileSize.h) * sizeof (real32);
 	
+	fTempBuffer.Reset (threadCount);
+	
 	for (uint32 threadIndex = 0; threadIndex < threadCount; threadIndex++)
 		{
 		
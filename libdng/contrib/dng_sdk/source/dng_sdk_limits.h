@@ -64,9 +64,11 @@ const uint32 kMaxMaskedAreas = 4;
 
 const uint32 kMaxImageSide = 65000;
 
-/// Maximum number of MP threads for dng_area_task operations.
+/// Default maximum number of MP threads for dng_area_task operations.
+/// Per thread buffers are sized at run time, the host picks the actual
+/// number of threads up to this.
 
-const uint32 kMaxMPThreads = 8;
+const uint32 kMaxMPThreads = 256;
 
 /*****************************************************************************/
 
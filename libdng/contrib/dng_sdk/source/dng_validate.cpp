@@ -34,6 +34,8 @@
 #include "dng_xmp.h"
 #include "dng_xmp_sdk.h"
 
+#include "dngprofile.h"
+
 /*****************************************************************************/
 
 #if qDNGValidateTarget
@@ -64,6 +66,8 @@ static dng_string gDumpStage3;
 static dng_string gDumpTIF;
 static dng_string gDumpDNG;
 
+static bool gMemoryReport = false;
+
 /*****************************************************************************/
 
 static dng_error_code dng_validate (const char *filename)
@@ -76,7 +80,11 @@ static dng_error_code dng_validate (const char *filename)
 	
 		dng_file_stream stream (filename);
 		
-		dng_host host;
+		// Accounts each allocation to the step that made it.
+		
+		DngMemoryTracker tracker;
+		
+		dng_host host (gMemoryReport ? &tracker : NULL);
 		
 		host.SetPreferredSize (gPreferredSize);
 		host.SetMinimumSize   (gMinimumSize  );
@@ -112,6 +120,8 @@ static dng_error_code dng_validate (const char *filename)
 			
 			dng_info info;
 			
+			tracker.SetLabel ("read");
+			
 			info.Parse (host, stream);
 			
 			info.PostParse (host);
@@ -131,6 +141,8 @@ static dng_error_code dng_validate (const char *filename)
 				
 				dng_timer timer ("Raw image read time");
 
+				tracker.SetLabel ("stage 1");
+				
 				negative->ReadStage1Image (host, stream, info);
 				
 				}
@@ -177,6 +189,8 @@ static dng_error_code dng_validate (const char *filename)
 			
 			dng_timer timer ("Linearization time");
 			
+			tracker.SetLabel ("stage 2");
+			
 			negative->BuildStage2Image (host,
 									    gMathDataType);
 						         
@@ -207,6 +221,8 @@ static dng_error_code dng_validate (const char *filename)
 			
 			dng_timer timer ("Interpolate time");
 		
+			tracker.SetLabel ("stage 3");
+			
 			negative->BuildStage3Image (host,
 									    gMosaicPlane);
 							
@@ -248,6 +264,8 @@ static dng_error_code dng_validate (const char *filename)
 				
 				dng_timer timer ("Build thumbnail time");
 				
+				tracker.SetLabel ("render");
+				
 				dng_render render (host, *negative);
 				
 				render.SetFinalSpace (negative->IsMonochrome () ? dng_space_GrayGamma22::Get ()
@@ -286,6 +304,8 @@ static dng_error_code dng_validate (const char *filename)
 				
 				dng_timer timer ("Write DNG time");
 			
+				tracker.SetLabel ("write dng");
+				
 				writer.WriteDNG (host,
 								 stream2,
 								 *negative.Get (),
@@ -326,6 +346,8 @@ static dng_error_code dng_validate (const char *filename)
 				
 				dng_timer timer ("Render time");
 			
+				tracker.SetLabel ("render");
+				
 				finalImage.Reset (render.Render ());
 				
 				}
@@ -354,6 +376,8 @@ static dng_error_code dng_validate (const char *filename)
 				
 				dng_timer timer ("Write TIFF time");
 			
+				tracker.SetLabel ("write tiff");
+				
 				writer.WriteTIFF (host,
 								  stream2,
 								  *finalImage.Get (),
@@ -368,6 +392,11 @@ static dng_error_code dng_validate (const char *filename)
 			gDumpTIF.Clear ();
 			
 			}
+			
+		if (gMemoryReport)
+			{
+			fputs (tracker.FormatText (filename).c_str (), stdout);
+			}
 					
 		}
 	
@@ -436,6 +465,7 @@ int main (int argc, char *argv [])
 					 "-3 <file>     Write stage 3 image to \"<file>.tif\"\n"
 					 "-tif <file>   Write TIF image to \"<file>.tif\"\n"
 					 "-dng <file>   Write DNG image to \"<file>.dng\"\n"
+					 "-memory       Report allocations per processing step\n"
 					 "\n",
 					 argv [0]);
 					 
@@ -457,6 +487,11 @@ int main (int argc, char *argv [])
 				gVerbose = true;
 				}
 				
+			else if (option.Matches ("memory", true))
+				{
+				gMemoryReport = true;
+				}
+				
 			else if (option.Matches ("d", true))
 				{
 					
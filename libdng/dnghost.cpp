@@ -25,13 +25,20 @@
 #include "dngnegative.h"
 #include "dngifd.h"
 #include "dngexif.h"
+#include "dngthreadpool.h"
 #include "dng_abort_sniffer.h"
 #include "dng_area_task.h"
+#include "dng_exceptions.h"
+#include "dng_mutex.h"
+#include "dng_rect.h"
+#include "dng_tile_iterator.h"
+
+#include <vector>
 
 
 #define kLocalUseThreads
 
-#if defined(kLocalUseThreads)
+#if defined(kLocalUseThreads) && !qDNGThreadSafe
 #if qWinOS
 #include <windows.h>
 #include <process.h>
@@ -40,12 +47,13 @@
 #endif
 #endif
 
-enum threadVals 
-{
-    kMaxLocalThreads = 16,
-};
+// 0 uses one thread per processor
+static uint32 gThreadCount = 0;
 
-#if defined(kLocalUseThreads)
+// Area tasks are split into one fixed rectangle per thread
+static bool gStaticAreaSplit = false;
+
+#if defined(kLocalUseThreads) && !qDNGThreadSafe
 //////////////////////////////////////////////////////////////
 //
 // cppThread class
@@ -187,27 +195,240 @@ private:
 
 #endif
 
-DngHost::DngHost(dng_memory_allocator *allocator, 
-                 dng_abort_sniffer *sniffer)
-    : dng_host(allocator, sniffer)
+#if qDNGThreadSafe
+//////////////////////////////////////////////////////////////
+//
+// areaTaskRun and areaJob classes
+//
+//////////////////////////////////////////////////////////////
+// areaTaskRun is the state of one PerformAreaTask call on the
+// thread pool. The area's tiles go into one list that every
+// thread working on the task takes the next tile from, so a
+// thread that got cheap tiles keeps going until none are left
+// instead of waiting for one with an expensive strip. Tiles are
+// large enough that a lock per tile does not show up.
+
+class areaTaskRun
 {
-}
+public:
+    areaTaskRun(dng_area_task &taskVal,
+                const dng_rect &area,
+                const dng_point &tileSize,
+                dng_abort_sniffer *snifferVal) :
+        task(taskVal),
+        sniffer(snifferVal),
+        mutex("areaTaskRun"),
+        jobsDone(),
+        tiles(),
+        nextTile(0),
+        running(0),
+        error(dng_error_none)
+    {
+        collectTiles(area, tileSize);
+    }
 
-DngHost::~DngHost(void)
+    uint32 tileCount() const
+    {
+        return static_cast<uint32>(tiles.size());
+    }
+
+    // Processes tiles with threadIndex's buffers until none are left
+    void process(uint32 threadIndex)
+    {
+        dng_rect tile;
+        while (nextOne(tile))
+        {
+            try
+            {
+                dng_abort_sniffer::SniffForAbort (sniffer);
+                task.Process (threadIndex, tile, sniffer);
+            }
+            catch (const dng_exception &except)
+            {
+                fail(except.ErrorCode());
+            }
+            catch (...)
+            {
+                fail(dng_error_unknown);
+            }
+        }
+    }
+
+    // Processes all tiles of threadArea, for the static split
+    void processArea(uint32 threadIndex, const dng_rect &threadArea, const dng_point &tileSize)
+    {
+        try
+        {
+            task.ProcessOnThread (threadIndex, threadArea, tileSize, sniffer);
+        }
+        catch (const dng_exception &except)
+        {
+            fail(except.ErrorCode());
+        }
+        catch (...)
+        {
+            fail(dng_error_unknown);
+        }
+    }
+
+    void submitted()
+    {
+        dng_lock_mutex lock(&mutex);
+        running++;
+    }
+
+    void finished()
+    {
+        dng_lock_mutex lock(&mutex);
+        if (--running == 0)
+            jobsDone.Broadcast();
+    }
+
+    // Waits for the jobs the pool picked up and rethrows the first error
+    void wait()
+    {
+        dng_error_code result;
+        {
+            dng_lock_mutex lock(&mutex);
+            while (running > 0)
+            {
+                jobsDone.Wait(mutex);
+            }
+            result = error;
+        }
+
+        if (result != dng_error_none)
+        {
+            Throw_dng_error(result);
+        }
+    }
+
+private:
+    // The tiles ProcessOnThread would pass to Process for the whole area
+    void collectTiles(const dng_rect &area, const dng_point &tileSize)
+    {
+        dng_rect repeatingTile1 = task.RepeatingTile1 ();
+        dng_rect repeatingTile2 = task.RepeatingTile2 ();
+        dng_rect repeatingTile3 = task.RepeatingTile3 ();
+
+        if (repeatingTile1.IsEmpty ())
+            repeatingTile1 = area;
+        if (repeatingTile2.IsEmpty ())
+            repeatingTile2 = area;
+        if (repeatingTile3.IsEmpty ())
+            repeatingTile3 = area;
+
+        dng_rect tile1, tile2, tile3, tile4;
+        dng_tile_iterator iter1 (repeatingTile3, area);
+        while (iter1.GetOneTile (tile1))
+        {
+            dng_tile_iterator iter2 (repeatingTile2, tile1);
+            while (iter2.GetOneTile (tile2))
+            {
+                dng_tile_iterator iter3 (repeatingTile1, tile2);
+                while (iter3.GetOneTile (tile3))
+                {
+                    dng_tile_iterator iter4 (tileSize, tile3);
+                    while (iter4.GetOneTile (tile4))
+                    {
+                        tiles.push_back(tile4);
+                    }
+                }
+            }
+        }
+    }
+
+    // the remaining tiles are skipped once one of them failed
+    bool nextOne(dng_rect &tile)
+    {
+        dng_lock_mutex lock(&mutex);
+        if (error != dng_error_none || nextTile >= tiles.size())
+            return false;
+        tile = tiles[nextTile++];
+        return true;
+    }
+
+    void fail(dng_error_code code)
+    {
+        dng_lock_mutex lock(&mutex);
+        if (error == dng_error_none)
+            error = code;
+    }
+
+private:
+    dng_area_task &task;
+    dng_abort_sniffer *sniffer;
+    dng_mutex mutex;
+    dng_condition jobsDone;
+    std::vector<dng_rect> tiles;
+    size_t nextTile;
+    uint32 running;
+    dng_error_code error;
+};
+
+class areaJob : public DngThreadPool::Job
 {
-}
+public:
+    areaJob(areaTaskRun *runVal,
+            uint32 threadIndexVal) :
+        run(runVal),
+        threadIndex(threadIndexVal)
+    {
+    }
 
-void DngHost::PerformAreaTask(dng_area_task &task,
-                              const dng_rect &area) 
+    // Called by the pool's thread
+    virtual void Run()
+    {
+        run->process(threadIndex);
+        run->finished();
+    }
+
+private:
+    areaTaskRun *run;
+    uint32 threadIndex;
+};
+
+// Works on one fixed rectangle of the area
+class staticAreaJob : public DngThreadPool::Job
 {
-    dng_point tileSize (task.FindTileSize (area));
+public:
+    staticAreaJob(areaTaskRun *runVal,
+                  uint32 threadIndexVal,
+                  const dng_rect &threadAreaVal,
+                  const dng_point &tileSizeVal) :
+        run(runVal),
+        threadIndex(threadIndexVal),
+        threadArea(threadAreaVal),
+        tileSize(tileSizeVal)
+    {
+    }
 
-#if defined(kLocalUseThreads)
-    // Now we need to do some resource allocation
-    // We start by assuming one tile per thread, and work our way up
-    // Note that a thread pool is technically a better idea, but very complex
-    // in a Mac/Windows environment; this is the cheap and cheerful solution
+    // Called by the pool's thread, or by the caller once withdrawn
+    virtual void Run()
+    {
+        run->processArea(threadIndex, threadArea, tileSize);
+        run->finished();
+    }
 
+private:
+    areaTaskRun *run;
+    uint32 threadIndex;
+    dng_rect threadArea;
+    dng_point tileSize;
+};
+
+static dng_mutex gSharedPoolMutex("DngHost::SharedThreadPool");
+static DngThreadPool *gSharedPool = NULL;
+
+#endif
+
+// Splits area into at most maxThreads rectangles of whole tiles
+static void splitArea(const dng_rect &area,
+                      const dng_point &tileSize,
+                      int maxThreads,
+                      std::vector<dng_rect> &threadAreas)
+{
+    // We start by assuming one tile per thread, and work our way up
     int vTilesPerThread = 1;
     int hTilesPerThread = 1;
     int vTilesinArea = area.H()/tileSize.v;
@@ -216,11 +437,10 @@ void DngHost::PerformAreaTask(dng_area_task &task,
     hTilesinArea = hTilesinArea*((int) tileSize.h) < ((int) area.W()) ? hTilesinArea + 1 : hTilesinArea;
     dng_point vInc = tileSize;
     dng_point hInc = tileSize;
-    areaThread *localThreads[kMaxLocalThreads];
 
     // Ensure we don't exceed maxThreads for this task
     while (((vTilesinArea+vTilesPerThread-1)/vTilesPerThread)*((hTilesinArea+hTilesPerThread-1)/hTilesPerThread) >
-           Min_int32(task.MaxThreads (), kMaxLocalThreads)) 
+           maxThreads) 
     {
         // Here we want to increase the number of tiles per thread
         // So do we do that in the V or H dimension?
@@ -240,9 +460,7 @@ void DngHost::PerformAreaTask(dng_area_task &task,
 
     dng_rect threadArea(area.t, area.l, vInc.v+area.t, hInc.h+area.l);
 
-    task.Start (Min_uint32(task.MaxThreads (), kMaxLocalThreads), tileSize, &Allocator (), Sniffer ());
     int vIndex = 0;
-    int threadIndex = 0;
     while (vIndex < vTilesinArea) 
     {
         int hIndex = 0;
@@ -250,34 +468,158 @@ void DngHost::PerformAreaTask(dng_area_task &task,
         threadArea.r = hInc.h+threadArea.l;
         while (hIndex < hTilesinArea) 
         {
-            localThreads[threadIndex] = new areaThread(task,
-                                                       threadIndex,
-                                                       threadArea,
-                                                       tileSize,
-                                                       Sniffer ());
-            if (localThreads[threadIndex] != NULL) 
-            {
-                if (localThreads[threadIndex]->start() != 0) 
-                {
-                    delete localThreads[threadIndex];
-                    localThreads[threadIndex] = NULL;
-                }
-            }
-            if (localThreads[threadIndex] == NULL) 
-            {
-                // If something goes bad, do this non-threaded
-                task.ProcessOnThread (threadIndex, threadArea, tileSize, Sniffer ());
-            }
+            threadAreas.push_back(threadArea);
             threadArea = threadArea + hInc;
             threadArea.r = Min_int32 (threadArea.r, area.r);
             hIndex += hTilesPerThread;
-            threadIndex++;
         }
         threadArea = threadArea + vInc;
         threadArea.b = Min_int32 (threadArea.b, area.b);
         vIndex += vTilesPerThread;
     }
-    for (int i = 0; i < threadIndex; i++) 
+}
+
+DngHost::DngHost(dng_memory_allocator *allocator, 
+                 dng_abort_sniffer *sniffer,
+                 DngThreadPool *threadPool)
+    : dng_host(allocator, sniffer),
+      m_ThreadPool(threadPool)
+{
+}
+
+DngHost::~DngHost(void)
+{
+}
+
+void DngHost::SetThreadCount(uint32 count)
+{
+    gThreadCount = count;
+}
+
+void DngHost::SetStaticAreaSplit(bool staticSplit)
+{
+    gStaticAreaSplit = staticSplit;
+}
+
+uint32 DngHost::ThreadCount()
+{
+    return gThreadCount != 0 ? gThreadCount : DngThreadPool::ProcessorCount();
+}
+
+DngThreadPool& DngHost::SharedThreadPool()
+{
+#if qDNGThreadSafe
+    // never destroyed, its idle threads end with the process
+    dng_lock_mutex lock(&gSharedPoolMutex);
+    if (gSharedPool == NULL)
+        gSharedPool = new DngThreadPool(ThreadCount() - 1);
+    return *gSharedPool;
+#else
+    static DngThreadPool inlinePool(0);
+    return inlinePool;
+#endif
+}
+
+void DngHost::PerformAreaTask(dng_area_task &task,
+                              const dng_rect &area) 
+{
+    dng_point tileSize (task.FindTileSize (area));
+
+#if defined(kLocalUseThreads)
+    uint32 maxThreads = Min_uint32(task.MaxThreads (), ThreadCount ());
+
+#if qDNGThreadSafe
+    // The calling thread works on the tiles too. Threads of the pool that
+    // have not started once the caller ran out of tiles are taken back, so
+    // a pool kept busy by other conversions never holds up this task.
+    DngThreadPool &pool = m_ThreadPool != NULL ? *m_ThreadPool : SharedThreadPool();
+    areaTaskRun run(task, area, tileSize, Sniffer ());
+
+    maxThreads = Min_uint32(maxThreads, Min_uint32(pool.Threads () + 1, run.tileCount ()));
+    maxThreads = Max_uint32(maxThreads, 1);
+
+    task.Start (maxThreads, tileSize, &Allocator (), Sniffer ());
+
+    if (gStaticAreaSplit)
+    {
+        std::vector<dng_rect> threadAreas;
+        splitArea(area, tileSize, maxThreads, threadAreas);
+
+        std::vector<staticAreaJob> areaJobs;
+        areaJobs.reserve(threadAreas.size());
+        for (uint32 i = 0; i < threadAreas.size(); i++)
+            areaJobs.push_back(staticAreaJob(&run, i, threadAreas[i], tileSize));
+
+        for (uint32 i = 1; i < areaJobs.size(); i++)
+        {
+            run.submitted();
+            pool.Submit(&areaJobs[i]);
+        }
+
+        run.processArea(0, threadAreas[0], tileSize);
+
+        // A rectangle has to be worked on by someone, so the ones the pool
+        // has not started yet are done by the caller.
+        for (uint32 i = 1; i < areaJobs.size(); i++)
+        {
+            if (pool.Withdraw(&areaJobs[i]))
+                areaJobs[i].Run();
+        }
+    }
+    else
+    {
+        std::vector<areaJob> jobs;
+        jobs.reserve(maxThreads);
+        for (uint32 i = 0; i < maxThreads; i++)
+            jobs.push_back(areaJob(&run, i));
+
+        for (uint32 i = 1; i < maxThreads; i++)
+        {
+            run.submitted();
+            pool.Submit(&jobs[i]);
+        }
+
+        run.process(0);
+
+        for (uint32 i = 1; i < maxThreads; i++)
+        {
+            if (pool.Withdraw(&jobs[i]))
+                run.finished();
+        }
+    }
+
+    run.wait();
+#else
+    std::vector<dng_rect> threadAreas;
+    splitArea(area, tileSize, maxThreads, threadAreas);
+
+    task.Start (maxThreads, tileSize, &Allocator (), Sniffer ());
+
+    // Without pthreads every area gets a thread of its own
+    int threadCount = static_cast<int>(threadAreas.size());
+    std::vector<areaThread*> localThreads(threadCount);
+    for (int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+    {
+        localThreads[threadIndex] = new areaThread(task,
+                                                   threadIndex,
+                                                   threadAreas[threadIndex],
+                                                   tileSize,
+                                                   Sniffer ());
+        if (localThreads[threadIndex] != NULL) 
+        {
+            if (localThreads[threadIndex]->start() != 0) 
+            {
+                delete localThreads[threadIndex];
+                localThreads[threadIndex] = NULL;
+            }
+        }
+        if (localThreads[threadIndex] == NULL) 
+        {
+            // If something goes bad, do this non-threaded
+            task.ProcessOnThread (threadIndex, threadAreas[threadIndex], tileSize, Sniffer ());
+        }
+    }
+    for (int i = 0; i < threadCount; i++) 
     {
         if (localThreads[i] != NULL) 
         {
@@ -286,7 +628,8 @@ void DngHost::PerformAreaTask(dng_area_task &task,
             delete localThreads[i];
         }
     }
-    task.Finish (Min_uint32(task.MaxThreads (), kMaxLocalThreads));
+#endif
+    task.Finish (maxThreads);
 #else
     task.Start (1, tileSize, &Allocator (), Sniffer ());
     task.ProcessOnThread (0, area, tileSize, Sniffer ());
@@ -21,15 +21,40 @@
 
 #include "dng_host.h"
 
+class DngThreadPool;
+
+// DngHost runs area tasks on a thread pool that lives as long as the
+// process, the thread calling PerformAreaTask works on the task as well.
+// Exceptions thrown on the pool's threads are rethrown to the caller.
+
 class DngHost : public dng_host
 {
 public:
-    DngHost(dng_memory_allocator *allocator = NULL, dng_abort_sniffer *sniffer = NULL);
+    // threadPool NULL uses SharedThreadPool().
+    DngHost(dng_memory_allocator *allocator = NULL, dng_abort_sniffer *sniffer = NULL,
+            DngThreadPool *threadPool = NULL);
     ~DngHost(void);
 
+    // Most threads an area task runs on, the caller included. 0, the
+    // default, uses one per processor. Set it before the first area task,
+    // the shared pool is sized from it.
+    static void SetThreadCount(uint32 count);
+    static uint32 ThreadCount();
+
+    // Created on first use with ThreadCount() - 1 threads.
+    static DngThreadPool& SharedThreadPool();
+
+    // Splits area tasks into one fixed rectangle of tiles per thread
+    // instead of handing out single tiles, so benchmarks can compare the
+    // two. Off by default.
+    static void SetStaticAreaSplit(bool staticSplit);
+
 public:
     virtual dng_exif* Make_dng_exif();
     virtual dng_ifd* Make_dng_ifd();
     virtual dng_negative* Make_dng_negative();
     virtual void PerformAreaTask(dng_area_task &task, const dng_rect &area);
+
+private:
+    DngThreadPool *m_ThreadPool;
 };
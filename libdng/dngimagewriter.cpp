@@ -25,15 +25,17 @@
 #include <dng_image.h>
 #include <dng_color_space.h>
 
-static const int max_buf = 4096;
+// Compressed data is handed to the stream in blocks of this size
+static const uint32 kOutputBufferSize = 256 * 1024;
 
 struct DngStreamDestinationMgr 
         : public jpeg_destination_mgr
 {
-    JOCTET buffer[max_buf];
+    JOCTET* buffer;
+    uint32 size;
     dng_stream* stream;
 
-    DngStreamDestinationMgr(dng_stream* s);
+    DngStreamDestinationMgr(dng_stream* s, JOCTET* b, uint32 n);
 
     static void jpeg_init_buffer(jpeg_compress_struct* cinfo);
     static boolean jpeg_empty_buffer(jpeg_compress_struct* cinfo);
@@ -48,9 +50,9 @@ boolean DngStreamDestinationMgr::jpeg_empty_buffer(jpeg_compress_struct* cinfo)
 {
     DngStreamDestinationMgr* dest = (DngStreamDestinationMgr*)cinfo->dest;
 
-    dest->stream->Put(dest->buffer, max_buf);
+    dest->stream->Put(dest->buffer, dest->size);
     dest->next_output_byte = dest->buffer;
-    dest->free_in_buffer = max_buf;
+    dest->free_in_buffer = dest->size;
 
     return TRUE;
 }
@@ -59,19 +61,21 @@ void DngStreamDestinationMgr::jpeg_term_buffer(jpeg_compress_struct* cinfo)
 {
     DngStreamDestinationMgr* dest = (DngStreamDestinationMgr*)cinfo->dest;
 
-    uint32 n = max_buf - dest->free_in_buffer;
+    uint32 n = dest->size - static_cast<uint32>(dest->free_in_buffer);
     dest->stream->Put(dest->buffer, n);
 }
 
-DngStreamDestinationMgr::DngStreamDestinationMgr(dng_stream* s)
+DngStreamDestinationMgr::DngStreamDestinationMgr(dng_stream* s, JOCTET* b, uint32 n)
 {
     jpeg_destination_mgr::init_destination    = jpeg_init_buffer;
     jpeg_destination_mgr::empty_output_buffer = jpeg_empty_buffer;
     jpeg_destination_mgr::term_destination    = jpeg_term_buffer;
 
     this->stream = s;
+    buffer = b;
+    size = n;
     next_output_byte = buffer;
-    free_in_buffer = max_buf;
+    free_in_buffer = size;
 }
 
 DngImageWriter::DngImageWriter(void)
@@ -109,23 +113,8 @@ void DngImageWriter::WriteJPEG(dng_host &host,
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr       jerr;
 
-    DngStreamDestinationMgr dmgr(&stream);
-
-    AutoPtr<dng_memory_block> srcData(host.Allocate(image.Width() * image.Height() * 3 * sizeof(uint8)));
-
-    dng_pixel_buffer buffer;
-
-    buffer.fArea       = dng_rect(image.Height(), image.Width());
-    buffer.fPlane      = 0;
-    buffer.fPlanes     = 3;
-    buffer.fRowStep    = buffer.fPlanes * image.Width();
-    buffer.fColStep    = buffer.fPlanes;
-    buffer.fPlaneStep  = 1;
-    buffer.fPixelType  = ttByte;
-    buffer.fPixelSize  = TagTypeSize(ttByte);
-    buffer.fData       = srcData->Buffer();
-
-    image.Get(buffer);
+    AutoPtr<dng_memory_block> outData(host.Allocate(kOutputBufferSize));
+    DngStreamDestinationMgr dmgr(&stream, outData->Buffer_uint8(), kOutputBufferSize);
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_compress(&cinfo);
@@ -175,11 +164,56 @@ void DngImageWriter::WriteJPEG(dng_host &host,
     jpeg_set_quality (&cinfo, compression, true);
     jpeg_start_compress(&cinfo, true);
 
-    JSAMPROW row_pointer;
+    // The image is read one MCU row at a time. An image kept in one piece,
+    // like the rendered previews, is handed to libjpeg straight from its
+    // tile buffer, other layouts are copied to a strip buffer first.
+    uint32 stripRows = cinfo.max_v_samp_factor * DCTSIZE;
+    bool singleTile = ((image.RepeatingTile() & image.Bounds()) == image.Bounds());
+
+    AutoPtr<dng_memory_block> stripData;
+
+    dng_pixel_buffer strip;
+
+    strip.fPlane      = 0;
+    strip.fPlanes     = 3;
+    strip.fRowStep    = strip.fPlanes * image.Width();
+    strip.fColStep    = strip.fPlanes;
+    strip.fPlaneStep  = 1;
+    strip.fPixelType  = ttByte;
+    strip.fPixelSize  = TagTypeSize(ttByte);
+
+    JSAMPROW rows[DCTSIZE * MAX_SAMP_FACTOR];
+
     while (cinfo.next_scanline < cinfo.image_height)
     {
-        row_pointer = (JSAMPROW)buffer.ConstPixel_uint8(cinfo.next_scanline, 0);
-        jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+        uint32 top = cinfo.next_scanline;
+        uint32 count = Min_uint32(stripRows, cinfo.image_height - top);
+        dng_rect area(image.Bounds().t + top, image.Bounds().l,
+                      image.Bounds().t + top + count, image.Bounds().r);
+
+        if (singleTile)
+        {
+            dng_const_tile_buffer tile(image, area);
+            if ((tile.fPixelType == ttByte) && (tile.fPlane == 0) &&
+                    (tile.fColStep == 3) && (tile.fPlaneStep == 1))
+            {
+                for (uint32 row = 0; row < count; row++)
+                    rows[row] = (JSAMPROW)tile.ConstPixel_uint8(area.t + row, area.l);
+                jpeg_write_scanlines(&cinfo, rows, count);
+                continue;
+            }
+        }
+
+        if (!stripData.Get())
+            stripData.Reset(host.Allocate(stripRows * strip.fRowStep));
+
+        strip.fArea = area;
+        strip.fData = stripData->Buffer();
+        image.Get(strip);
+
+        for (uint32 row = 0; row < count; row++)
+            rows[row] = (JSAMPROW)strip.ConstPixel_uint8(area.t + row, area.l);
+        jpeg_write_scanlines(&cinfo, rows, count);
     }
 
     jpeg_finish_compress(&cinfo);
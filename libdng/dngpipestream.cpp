@@ -0,0 +1,66 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "dngpipestream.h"
+
+#include "dng_exceptions.h"
+
+DngPipeStream::DngPipeStream(FILE *file, uint32 bufferSize)
+    : dng_stream((dng_abort_sniffer *) NULL, bufferSize, 0),
+      m_File(file),
+      m_Written(0)
+{
+}
+
+DngPipeStream::~DngPipeStream(void)
+{
+}
+
+uint64 DngPipeStream::DoGetLength()
+{
+    return m_Written;
+}
+
+void DngPipeStream::DoRead(void * /* data */, uint32 /* count */, uint64 /* offset */)
+{
+    ThrowReadFile();
+}
+
+void DngPipeStream::DoSetLength(uint64 length)
+{
+    if (length != m_Written)
+    {
+        ThrowProgramError("DngPipeStream can not change its length");
+    }
+}
+
+void DngPipeStream::DoWrite(const void *data, uint32 count, uint64 offset)
+{
+    if (offset != m_Written)
+    {
+        ThrowProgramError("DngPipeStream can only append");
+    }
+
+    if (fwrite(data, 1, count, m_File) != count)
+    {
+        ThrowWriteFile();
+    }
+
+    m_Written += count;
+}
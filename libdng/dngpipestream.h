@@ -0,0 +1,50 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <stdio.h>
+
+#include "dng_stream.h"
+
+// Output stream on a FILE that can not seek, like stdout, a pipe or a
+// socket. Data must be written strictly front to back, a write anywhere
+// else throws dng_error_unknown.
+
+class DngPipeStream : public dng_stream
+{
+public:
+    DngPipeStream(FILE *file, uint32 bufferSize = kDefaultBufferSize);
+    virtual ~DngPipeStream(void);
+
+protected:
+    virtual uint64 DoGetLength();
+    virtual void DoRead(void *data, uint32 count, uint64 offset);
+    virtual void DoSetLength(uint64 length);
+    virtual void DoWrite(const void *data, uint32 count, uint64 offset);
+
+private:
+    FILE *m_File;
+    uint64 m_Written;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DngPipeStream(const DngPipeStream &stream);
+    DngPipeStream& operator=(const DngPipeStream &stream);
+};
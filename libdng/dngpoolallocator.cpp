@@ -0,0 +1,224 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "dngpoolallocator.h"
+
+#include <stdlib.h>
+
+#if qWinOS
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#include "dng_assertions.h"
+#include "dng_exceptions.h"
+#include "dng_utils.h"
+
+// Smaller blocks are cheap for malloc and not worth keeping around
+static const uint32 kMinPooledSize = 64 * 1024;
+static const uint32 kHugePageSize = 2 * 1024 * 1024;
+
+// Slack dng_memory_block::PhysicalSize() adds to the logical size, the SDK
+// may touch that much past the end of a block
+static const uint32 kBlockSlack = 64;
+
+// Block whose memory goes back to the pool when it is freed
+class DngPooledBlock : public dng_memory_block
+{
+public:
+    DngPooledBlock(uint32 logicalSize, void *memory, uint32 classSize, DngPoolAllocator *pool)
+        : dng_memory_block(logicalSize),
+          m_Memory(memory),
+          m_ClassSize(classSize),
+          m_Pool(pool)
+    {
+        SetBuffer(memory);
+
+        DNG_ASSERT(PhysicalSize() <= m_ClassSize, "Pooled block smaller than its physical size");
+    }
+
+    virtual ~DngPooledBlock(void)
+    {
+        m_Pool->Release(m_Memory, m_ClassSize);
+    }
+
+    static uint32 PhysicalSizeFor(uint32 logicalSize)
+    {
+        return logicalSize + kBlockSlack;
+    }
+
+private:
+    void *m_Memory;
+    uint32 m_ClassSize;
+    DngPoolAllocator *m_Pool;
+};
+
+DngPoolAllocator::DngPoolAllocator(uint64 maxCachedBytes, bool hugePages)
+    : m_MaxCachedBytes(maxCachedBytes),
+      m_HugePages(hugePages),
+      m_Mutex("DngPoolAllocator"),
+      m_FreeLists(),
+      m_CachedBytes(0),
+      m_Hits(0),
+      m_Misses(0)
+{
+}
+
+DngPoolAllocator::~DngPoolAllocator(void)
+{
+    Trim();
+}
+
+uint32 DngPoolAllocator::SizeClass(uint32 physicalSize) const
+{
+    if (m_HugePages && physicalSize >= kHugePageSize)
+        return (physicalSize + kHugePageSize - 1) & ~(kHugePageSize - 1);
+
+    uint32 step = 1;
+    while ((step << 1) <= physicalSize)
+        step <<= 1;
+    step = Max_uint32(step >> 2, 16);
+
+    return (physicalSize + step - 1) & ~(step - 1);
+}
+
+void* DngPoolAllocator::AllocateMemory(uint32 classSize, bool hugePages)
+{
+    void *memory = NULL;
+
+#if qWinOS
+    (void)hugePages;
+    memory = _aligned_malloc(classSize, 16);
+#else
+    size_t alignment = (hugePages && classSize >= kHugePageSize) ? kHugePageSize : 16;
+    if (posix_memalign(&memory, alignment, classSize) != 0)
+        memory = NULL;
+#if defined(MADV_HUGEPAGE)
+    if (memory != NULL && alignment == kHugePageSize)
+        madvise(memory, classSize, MADV_HUGEPAGE);
+#endif
+#endif
+
+    return memory;
+}
+
+void DngPoolAllocator::FreeMemory(void *memory)
+{
+#if qWinOS
+    _aligned_free(memory);
+#else
+    free(memory);
+#endif
+}
+
+dng_memory_block* DngPoolAllocator::Allocate(uint32 size)
+{
+    // sizes near 4 GB would overflow their size class
+    uint32 physicalSize = DngPooledBlock::PhysicalSizeFor(size);
+    if (physicalSize < kMinPooledSize || size > 0x7FFFFFFF)
+        return dng_memory_allocator::Allocate(size);
+
+    uint32 classSize = SizeClass(physicalSize);
+    void *memory = NULL;
+
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        FreeLists::iterator it = m_FreeLists.find(classSize);
+        if (it != m_FreeLists.end() && !it->second.empty())
+        {
+            memory = it->second.back();
+            it->second.pop_back();
+            m_CachedBytes -= classSize;
+            m_Hits++;
+        }
+        else
+        {
+            m_Misses++;
+        }
+    }
+
+    if (memory == NULL)
+    {
+        memory = AllocateMemory(classSize, m_HugePages);
+        if (memory == NULL)
+        {
+            ThrowMemoryFull();
+        }
+    }
+
+    dng_memory_block *result = new DngPooledBlock(size, memory, classSize, this);
+    if (!result)
+    {
+        Release(memory, classSize);
+        ThrowMemoryFull();
+    }
+
+    return result;
+}
+
+void DngPoolAllocator::Release(void *memory, uint32 classSize)
+{
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        if (m_CachedBytes + classSize <= m_MaxCachedBytes)
+        {
+            m_FreeLists[classSize].push_back(memory);
+            m_CachedBytes += classSize;
+            return;
+        }
+    }
+
+    FreeMemory(memory);
+}
+
+uint64 DngPoolAllocator::Hits()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_Hits;
+}
+
+uint64 DngPoolAllocator::Misses()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_Misses;
+}
+
+uint64 DngPoolAllocator::CachedBytes()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_CachedBytes;
+}
+
+void DngPoolAllocator::Trim()
+{
+    FreeLists lists;
+
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        lists.swap(m_FreeLists);
+        m_CachedBytes = 0;
+    }
+
+    for (FreeLists::iterator it = lists.begin(); it != lists.end(); ++it)
+    {
+        for (size_t i = 0; i < it->second.size(); i++)
+            FreeMemory(it->second[i]);
+    }
+}
@@ -0,0 +1,81 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "dng_memory.h"
+#include "dng_mutex.h"
+#include "dng_types.h"
+
+// DngPoolAllocator keeps freed blocks of 64 KB and more on free lists by
+// size class and hands them out again, so the tile, stage image and write
+// buffers a batch run allocates over and over are not returned to the heap
+// and faulted in again for every file. Sizes are rounded up to a quarter of
+// their power of two. Smaller blocks come from malloc as before.
+//
+// One pool is shared by all threads and conversions of the process. At most
+// maxCachedBytes are kept, blocks freed beyond that go back to the heap.
+// With hugePages, blocks of 2 MB and more are 2 MB aligned and marked for
+// transparent huge pages where the system supports it. Blocks must be freed
+// before the pool is destroyed.
+
+class DngPoolAllocator : public dng_memory_allocator
+{
+public:
+    DngPoolAllocator(uint64 maxCachedBytes, bool hugePages = false);
+    virtual ~DngPoolAllocator(void);
+
+    virtual dng_memory_block* Allocate(uint32 size);
+
+    // Blocks served from a free list and ones that had to be allocated.
+    uint64 Hits();
+    uint64 Misses();
+    uint64 CachedBytes();
+
+    // Frees all cached blocks.
+    void Trim();
+
+    // Called by the pool's blocks when they are freed.
+    void Release(void *memory, uint32 classSize);
+
+private:
+    uint32 SizeClass(uint32 physicalSize) const;
+
+    static void* AllocateMemory(uint32 classSize, bool hugePages);
+    static void FreeMemory(void *memory);
+
+private:
+    typedef std::map<uint32, std::vector<void*> > FreeLists;
+
+    uint64 m_MaxCachedBytes;
+    bool m_HugePages;
+    dng_mutex m_Mutex;
+    FreeLists m_FreeLists;
+    uint64 m_CachedBytes;
+    uint64 m_Hits;
+    uint64 m_Misses;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DngPoolAllocator(const DngPoolAllocator &allocator);
+    DngPoolAllocator& operator=(const DngPoolAllocator &allocator);
+};
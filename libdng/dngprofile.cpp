@@ -0,0 +1,434 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "dngprofile.h"
+
+#include <stdio.h>
+
+#include "dng_auto_ptr.h"
+#include "dng_exceptions.h"
+#include "dng_utils.h"
+
+#if qWinOS
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+static std::string jsonString(const char *value)
+{
+    std::string result = "\"";
+
+    for (const char *p = value; *p; p++)
+    {
+        switch (*p)
+        {
+        case '"':
+            result += "\\\"";
+            break;
+        case '\\':
+            result += "\\\\";
+            break;
+        default:
+            if (static_cast<unsigned char>(*p) < 0x20)
+            {
+                char escape[8];
+                sprintf(escape, "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(*p)));
+                result += escape;
+            }
+            else
+            {
+                result += *p;
+            }
+        }
+    }
+
+    return result + "\"";
+}
+
+// Block that reports its size back to the tracker when it is freed
+class DngTrackedBlock : public dng_memory_block
+{
+public:
+    DngTrackedBlock(dng_memory_block *block, DngMemoryTracker *tracker, uint32 label)
+        : dng_memory_block(block->LogicalSize()),
+          m_Block(block),
+          m_Tracker(tracker),
+          m_Label(label)
+    {
+        SetBuffer(block->Buffer());
+    }
+
+    virtual ~DngTrackedBlock(void)
+    {
+        m_Tracker->Release(LogicalSize(), m_Label);
+        delete m_Block;
+    }
+
+private:
+    dng_memory_block *m_Block;
+    DngMemoryTracker *m_Tracker;
+    uint32 m_Label;
+};
+
+// number of blocks kept for the largest blocks list
+static const size_t kLargestBlocks = 8;
+
+DngMemoryTracker::DngMemoryTracker(dng_memory_allocator &allocator)
+    : m_Allocator(allocator),
+      m_Mutex("DngMemoryTracker"),
+      m_Current(0),
+      m_Peak(0),
+      m_Max(0),
+      m_Label("other"),
+      m_Labels(),
+      m_Largest()
+{
+}
+
+uint32 DngMemoryTracker::LabelIndex(const char *label)
+{
+    for (size_t i = 0; i < m_Labels.size(); i++)
+    {
+        if (m_Labels[i].fLabel == label)
+            return static_cast<uint32>(i);
+    }
+
+    LabelStats stats;
+    stats.fLabel = label;
+    stats.fCount = 0;
+    stats.fBytes = 0;
+    stats.fLiveBytes = 0;
+    stats.fPeakBytes = 0;
+    stats.fLargest = 0;
+    m_Labels.push_back(stats);
+    return static_cast<uint32>(m_Labels.size() - 1);
+}
+
+dng_memory_block* DngMemoryTracker::Allocate(uint32 size)
+{
+    AutoPtr<dng_memory_block> block(m_Allocator.Allocate(size));
+
+    dng_lock_mutex lock(&m_Mutex);
+
+    uint32 label = LabelIndex(m_Label);
+    dng_memory_block *result = new DngTrackedBlock(block.Get(), this, label);
+    if (!result)
+    {
+        ThrowMemoryFull();
+    }
+    block.Release();
+
+    m_Current += size;
+    if (m_Current > m_Peak)
+        m_Peak = m_Current;
+    if (m_Current > m_Max)
+        m_Max = m_Current;
+
+    LabelStats &stats = m_Labels[label];
+    stats.fCount++;
+    stats.fBytes += size;
+    stats.fLiveBytes += size;
+    if (stats.fLiveBytes > stats.fPeakBytes)
+        stats.fPeakBytes = stats.fLiveBytes;
+    if (size > stats.fLargest)
+        stats.fLargest = size;
+
+    // kept sorted by size, largest first
+    if (m_Largest.size() < kLargestBlocks || size > m_Largest.back().fSize)
+    {
+        Block entry;
+        entry.fSize = size;
+        entry.fLabel = label;
+
+        std::vector<Block>::iterator it = m_Largest.begin();
+        while (it != m_Largest.end() && it->fSize >= size)
+            ++it;
+        m_Largest.insert(it, entry);
+        if (m_Largest.size() > kLargestBlocks)
+            m_Largest.pop_back();
+    }
+
+    return result;
+}
+
+void DngMemoryTracker::Release(uint32 size, uint32 label)
+{
+    dng_lock_mutex lock(&m_Mutex);
+    m_Current -= size;
+    m_Labels[label].fLiveBytes -= size;
+}
+
+uint64 DngMemoryTracker::CurrentBytes()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_Current;
+}
+
+uint64 DngMemoryTracker::PeakBytes()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_Peak;
+}
+
+uint64 DngMemoryTracker::ResetPeak()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    uint64 peak = m_Peak;
+    m_Peak = m_Current;
+    return peak;
+}
+
+void DngMemoryTracker::RaisePeak(uint64 bytes)
+{
+    dng_lock_mutex lock(&m_Mutex);
+    if (bytes > m_Peak)
+        m_Peak = bytes;
+}
+
+uint64 DngMemoryTracker::MaxBytes()
+{
+    dng_lock_mutex lock(&m_Mutex);
+    return m_Max;
+}
+
+const char* DngMemoryTracker::SetLabel(const char *label)
+{
+    dng_lock_mutex lock(&m_Mutex);
+    const char *previous = m_Label;
+    m_Label = label;
+    return previous;
+}
+
+std::string DngMemoryTracker::FormatText(const char *file)
+{
+    dng_lock_mutex lock(&m_Mutex);
+
+    std::string result;
+    char line[256];
+
+    sprintf(line, "%-20s %9.1f MB max live  ", "memory", m_Max / (1024.0 * 1024.0));
+    result += line;
+    result += file;
+    result += "\n";
+
+    for (size_t i = 0; i < m_Labels.size(); i++)
+    {
+        const LabelStats &stats = m_Labels[i];
+        sprintf(line, "  %-18s %6llu x %9.1f MB total %9.1f MB peak live %9.1f MB largest\n",
+                stats.fLabel.c_str(), static_cast<unsigned long long>(stats.fCount),
+                stats.fBytes / (1024.0 * 1024.0), stats.fPeakBytes / (1024.0 * 1024.0),
+                stats.fLargest / (1024.0 * 1024.0));
+        result += line;
+    }
+
+    for (size_t i = 0; i < m_Largest.size(); i++)
+    {
+        sprintf(line, "  largest block %-4u %9.1f MB %s\n", static_cast<uint32>(i + 1),
+                m_Largest[i].fSize / (1024.0 * 1024.0), m_Labels[m_Largest[i].fLabel].fLabel.c_str());
+        result += line;
+    }
+
+    return result;
+}
+
+std::string DngMemoryTracker::FormatJSON()
+{
+    dng_lock_mutex lock(&m_Mutex);
+
+    char numbers[160];
+    sprintf(numbers, "{\"max_bytes\":%llu,\"labels\":[", static_cast<unsigned long long>(m_Max));
+    std::string result = numbers;
+
+    for (size_t i = 0; i < m_Labels.size(); i++)
+    {
+        const LabelStats &stats = m_Labels[i];
+        if (i > 0)
+            result += ",";
+        result += "{\"name\":" + jsonString(stats.fLabel.c_str());
+        sprintf(numbers, ",\"count\":%llu,\"bytes\":%llu,\"peak_bytes\":%llu,\"largest\":%u}",
+                static_cast<unsigned long long>(stats.fCount), static_cast<unsigned long long>(stats.fBytes),
+                static_cast<unsigned long long>(stats.fPeakBytes), stats.fLargest);
+        result += numbers;
+    }
+
+    result += "],\"largest\":[";
+    for (size_t i = 0; i < m_Largest.size(); i++)
+    {
+        if (i > 0)
+            result += ",";
+        sprintf(numbers, "{\"bytes\":%u,\"label\":", m_Largest[i].fSize);
+        result += numbers + jsonString(m_Labels[m_Largest[i].fLabel].fLabel.c_str()) + "}";
+    }
+
+    return result + "]}";
+}
+
+DngProfile::DngProfile(DngMemoryTracker *tracker)
+    : m_Tracker(tracker),
+      m_Phases()
+{
+}
+
+DngMemoryTracker* DngProfile::Tracker()
+{
+    return m_Tracker;
+}
+
+void DngProfile::Add(const char *name, real64 wallTime, real64 cpuTime, uint64 peakBytes)
+{
+    for (size_t i = 0; i < m_Phases.size(); i++)
+    {
+        Phase &phase = m_Phases[i];
+        if (phase.fName == name)
+        {
+            phase.fCount++;
+            phase.fWallTime += wallTime;
+            phase.fCPUTime += cpuTime;
+            if (peakBytes > phase.fPeakBytes)
+                phase.fPeakBytes = peakBytes;
+            return;
+        }
+    }
+
+    Phase phase;
+    phase.fName = name;
+    phase.fCount = 1;
+    phase.fWallTime = wallTime;
+    phase.fCPUTime = cpuTime;
+    phase.fPeakBytes = peakBytes;
+    m_Phases.push_back(phase);
+}
+
+const std::vector<DngProfile::Phase>& DngProfile::Phases() const
+{
+    return m_Phases;
+}
+
+std::string DngProfile::FormatText(const char *file) const
+{
+    std::string result;
+    char line[256];
+
+    for (size_t i = 0; i < m_Phases.size(); i++)
+    {
+        const Phase &phase = m_Phases[i];
+        sprintf(line, "%-20s %3u x %9.3f s wall %9.3f s cpu %9.1f MB peak  ",
+                phase.fName.c_str(), phase.fCount, phase.fWallTime, phase.fCPUTime,
+                phase.fPeakBytes / (1024.0 * 1024.0));
+        result += line;
+        result += file;
+        result += "\n";
+    }
+
+    if (m_Tracker != NULL)
+        result += m_Tracker->FormatText(file);
+
+    return result;
+}
+
+std::string DngProfile::FormatJSON(const char *file) const
+{
+    std::string result = "{\"file\":" + jsonString(file) + ",\"phases\":[";
+    char numbers[160];
+
+    for (size_t i = 0; i < m_Phases.size(); i++)
+    {
+        const Phase &phase = m_Phases[i];
+        if (i > 0)
+            result += ",";
+        result += "{\"name\":" + jsonString(phase.fName.c_str());
+        sprintf(numbers, ",\"count\":%u,\"wall\":%.6f,\"cpu\":%.6f,\"peak_bytes\":%llu}",
+                phase.fCount, phase.fWallTime, phase.fCPUTime,
+                static_cast<unsigned long long>(phase.fPeakBytes));
+        result += numbers;
+    }
+
+    result += "]";
+    if (m_Tracker != NULL)
+        result += ",\"memory\":" + m_Tracker->FormatJSON();
+
+    return result + "}\n";
+}
+
+real64 DngProfile::CPUTimeInSeconds()
+{
+#if qWinOS
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0.0;
+    uint64 k = (static_cast<uint64>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+    uint64 u = (static_cast<uint64>(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+    return (k + u) * 1.0e-7;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0.0;
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1.0e-6;
+#endif
+}
+
+DngProfileScope::DngProfileScope(DngProfile *profile, const char *name)
+    : m_Profile(profile),
+      m_Name(name),
+      m_WallStart(0.0),
+      m_CPUStart(0.0),
+      m_OuterPeak(0),
+      m_OuterLabel(NULL)
+{
+    if (m_Profile == NULL)
+        return;
+
+    if (m_Profile->Tracker() != NULL)
+    {
+        m_OuterPeak = m_Profile->Tracker()->ResetPeak();
+        m_OuterLabel = m_Profile->Tracker()->SetLabel(name);
+    }
+
+    m_WallStart = TickTimeInSeconds();
+    m_CPUStart = DngProfile::CPUTimeInSeconds();
+}
+
+DngProfileScope::~DngProfileScope(void)
+{
+    Stop();
+}
+
+void DngProfileScope::Stop()
+{
+    if (m_Profile == NULL)
+        return;
+
+    real64 wallTime = TickTimeInSeconds() - m_WallStart;
+    real64 cpuTime = DngProfile::CPUTimeInSeconds() - m_CPUStart;
+
+    uint64 peak = 0;
+    if (m_Profile->Tracker() != NULL)
+    {
+        // the enclosing scope sees the larger of both peaks
+        peak = m_Profile->Tracker()->PeakBytes();
+        m_Profile->Tracker()->RaisePeak(m_OuterPeak);
+        m_Profile->Tracker()->SetLabel(m_OuterLabel);
+    }
+
+    m_Profile->Add(m_Name, wallTime, cpuTime, peak);
+    m_Profile = NULL;
+}
@@ -0,0 +1,155 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "dng_memory.h"
+#include "dng_mutex.h"
+#include "dng_types.h"
+
+// DngMemoryTracker hands out blocks from another allocator and keeps
+// count of the bytes currently held and the peak since the last ResetPeak().
+// Each allocation is also accounted to the label set when it was made, with
+// its count, total and peak live bytes and largest block, and the largest
+// blocks overall are kept.
+
+class DngMemoryTracker : public dng_memory_allocator
+{
+public:
+    struct LabelStats
+    {
+        std::string fLabel;
+        uint64 fCount;
+        uint64 fBytes;
+        uint64 fLiveBytes;
+        uint64 fPeakBytes;
+        uint32 fLargest;
+    };
+
+    struct Block
+    {
+        uint32 fSize;
+        uint32 fLabel;
+    };
+
+public:
+    DngMemoryTracker(dng_memory_allocator &allocator = gDefaultDNGMemoryAllocator);
+
+    virtual dng_memory_block* Allocate(uint32 size);
+
+    uint64 CurrentBytes();
+    uint64 PeakBytes();
+
+    // Starts a new peak at the current size and returns the previous peak.
+    uint64 ResetPeak();
+    void RaisePeak(uint64 bytes);
+
+    // Highest number of bytes held at once, not affected by ResetPeak().
+    uint64 MaxBytes();
+
+    // Accounts later allocations to label and returns the previous label.
+    // Labels are not copied, string literals are fine.
+    const char* SetLabel(const char *label);
+
+    // Per label accounting and the largest blocks, one line each, or a
+    // JSON object without a line break.
+    std::string FormatText(const char *file);
+    std::string FormatJSON();
+
+    void Release(uint32 size, uint32 label);
+
+private:
+    uint32 LabelIndex(const char *label);
+
+private:
+    dng_memory_allocator &m_Allocator;
+    dng_mutex m_Mutex;
+    uint64 m_Current;
+    uint64 m_Peak;
+    uint64 m_Max;
+    const char *m_Label;
+    std::vector<LabelStats> m_Labels;
+    std::vector<Block> m_Largest;
+};
+
+// DngProfile collects wall time, CPU time and peak tracked memory per named
+// phase of a conversion. Phases recorded more than once are summed up and
+// keep the highest peak. CPU time is that of the whole process, so it
+// includes the SDK's worker threads and other conversions running at the
+// same time.
+
+class DngProfile
+{
+public:
+    struct Phase
+    {
+        std::string fName;
+        uint32 fCount;
+        real64 fWallTime;
+        real64 fCPUTime;
+        uint64 fPeakBytes;
+    };
+
+public:
+    DngProfile(DngMemoryTracker *tracker = NULL);
+
+    DngMemoryTracker* Tracker();
+
+    void Add(const char *name, real64 wallTime, real64 cpuTime, uint64 peakBytes);
+    const std::vector<Phase>& Phases() const;
+
+    // One line per phase, or a single JSON object on one line.
+    std::string FormatText(const char *file) const;
+    std::string FormatJSON(const char *file) const;
+
+    static real64 CPUTimeInSeconds();
+
+private:
+    DngMemoryTracker *m_Tracker;
+    std::vector<Phase> m_Phases;
+};
+
+// Records the time spent between construction and Stop() or destruction as
+// a phase of profile and accounts the memory allocated meanwhile to the
+// phase's name. Does nothing if profile is NULL.
+
+class DngProfileScope
+{
+public:
+    DngProfileScope(DngProfile *profile, const char *name);
+    ~DngProfileScope(void);
+
+    void Stop();
+
+private:
+    DngProfile *m_Profile;
+    const char *m_Name;
+    real64 m_WallStart;
+    real64 m_CPUStart;
+    uint64 m_OuterPeak;
+    const char *m_OuterLabel;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DngProfileScope(const DngProfileScope &scope);
+    DngProfileScope& operator=(const DngProfileScope &scope);
+};
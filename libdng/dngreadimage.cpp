@@ -20,69 +20,65 @@
 #include "dngreadimage.h"
 
 #include <dng_host.h>
+#include <dng_ifd.h>
+#include <dng_image.h>
 #include <dng_stream.h>
 
+#include <setjmp.h>
+#include <stdio.h>
 #include <jpeglib.h>
 
 #include <iostream>
 
-static const int max_buf = 4096;
+// Rows decoded per strip before they are put into the image
+static const uint32 kStripRows = 16;
 
-struct DngStreamSourceMgr 
+struct DngMemorySourceMgr
         : public jpeg_source_mgr
 {
-    JOCTET buffer[max_buf];
-    dng_stream* stream;
-    uint32 bytes;
-
-    DngStreamSourceMgr(dng_stream* s, uint32 b);
+    DngMemorySourceMgr(const void* data, uint32 size);
 
     static void jpeg_init_buffer(jpeg_decompress_struct* cinfo);
     static boolean jpeg_fill_input_buffer(jpeg_decompress_struct* cinfo);
     static void jpeg_skip_input_data(jpeg_decompress_struct* cinfo, long num_bytes);
-    static boolean jpeg_resync_to_restart(jpeg_decompress_struct* cinfo, int desired);
     static void jpeg_term_source(jpeg_decompress_struct* cinfo);
 };
 
-void DngStreamSourceMgr::jpeg_init_buffer(jpeg_decompress_struct* /*cinfo*/)
+void DngMemorySourceMgr::jpeg_init_buffer(jpeg_decompress_struct* /*cinfo*/)
 {
 }
 
-boolean DngStreamSourceMgr::jpeg_fill_input_buffer(jpeg_decompress_struct* cinfo)
+boolean DngMemorySourceMgr::jpeg_fill_input_buffer(jpeg_decompress_struct* cinfo)
 {
-    DngStreamSourceMgr* src = (DngStreamSourceMgr*)cinfo->src;
-    src->stream->Get(src->buffer, max_buf);
-    src->next_input_byte = src->buffer;
-    src->bytes_in_buffer = max_buf;
+    // the whole image is in memory, so running out of data means a truncated
+    // file; hand libjpeg an EOI marker like the stdio source manager does
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
     return true;
 }
 
-void DngStreamSourceMgr::jpeg_skip_input_data(jpeg_decompress_struct* cinfo, long num_bytes)
+void DngMemorySourceMgr::jpeg_skip_input_data(jpeg_decompress_struct* cinfo, long num_bytes)
 {
-    DngStreamSourceMgr* src = (DngStreamSourceMgr*)cinfo->src;
+    if (num_bytes <= 0)
+        return;
 
-    if (num_bytes > 0)
+    if (num_bytes > static_cast<long>(cinfo->src->bytes_in_buffer))
     {
-        while (num_bytes > static_cast<long>(src->bytes_in_buffer))
-        {
-            num_bytes -= static_cast<long>(src->bytes_in_buffer);
-            (void)jpeg_fill_input_buffer(cinfo);
-        }
+        (void)jpeg_fill_input_buffer(cinfo);
+        return;
     }
-    src->next_input_byte += static_cast<size_t>(num_bytes);
-    src->bytes_in_buffer -= static_cast<size_t>(num_bytes);
-}
 
-boolean DngStreamSourceMgr::jpeg_resync_to_restart(jpeg_decompress_struct* /*cinfo*/, int /*desired*/)
-{
-    return false;
+    cinfo->src->next_input_byte += static_cast<size_t>(num_bytes);
+    cinfo->src->bytes_in_buffer -= static_cast<size_t>(num_bytes);
 }
 
-void DngStreamSourceMgr::jpeg_term_source(jpeg_decompress_struct* /*cinfo*/)
+void DngMemorySourceMgr::jpeg_term_source(jpeg_decompress_struct* /*cinfo*/)
 {
 }
 
-DngStreamSourceMgr::DngStreamSourceMgr(dng_stream* s, uint32 b)
+DngMemorySourceMgr::DngMemorySourceMgr(const void* data, uint32 size)
 {
     jpeg_source_mgr::init_source       = jpeg_init_buffer;
     jpeg_source_mgr::fill_input_buffer = jpeg_fill_input_buffer;
@@ -90,32 +86,126 @@ DngStreamSourceMgr::DngStreamSourceMgr(dng_stream* s, uint32 b)
     jpeg_source_mgr::resync_to_restart = jpeg_resync_to_restart;
     jpeg_source_mgr::term_source       = jpeg_term_source;
 
-    this->stream = s;
-    this->bytes = b;
-
-    bytes_in_buffer = 0;
-    next_input_byte = buffer;
+    next_input_byte = static_cast<const JOCTET*>(data);
+    bytes_in_buffer = size;
 }
 
-struct DngStreamErrorMgr
+struct DngJpegErrorMgr
         : public jpeg_error_mgr
 {
-    dng_host* host;
+    jmp_buf setjmp_buffer;
 
-    DngStreamErrorMgr(dng_host* h);
+    static void jpeg_error_exit(j_common_ptr cinfo);
 };
 
-DngStreamErrorMgr::DngStreamErrorMgr(dng_host* h)
+void DngJpegErrorMgr::jpeg_error_exit(j_common_ptr cinfo)
+{
+    // the default handler exits the process, return to the caller instead
+    DngJpegErrorMgr* err = (DngJpegErrorMgr*)cinfo->err;
+    longjmp(err->setjmp_buffer, 1);
+}
+
+// Owns a libjpeg decompressor reading from memory. Each call into libjpeg
+// has its own setjmp point in a function that only holds plain values, so
+// the longjmp of an error never skips a destructor; errors are returned as
+// false instead. The decompressor is destroyed with the object, also when
+// the caller throws.
+class DngJpegDecoder
+{
+public:
+    DngJpegDecoder(const void* data, uint32 size);
+    ~DngJpegDecoder(void);
+
+    bool ReadHeader();
+    bool Start(J_COLOR_SPACE colorSpace, uint32 scaleDenom);
+    // Reads the next count rows, false on an error.
+    bool ReadRows(JSAMPROW* rows, uint32 count);
+    bool Finish();
+
+    const jpeg_decompress_struct& Info() const { return m_Info; }
+
+private:
+    DngMemorySourceMgr m_Source;
+    DngJpegErrorMgr m_Error;
+    jpeg_decompress_struct m_Info;
+    bool m_Created;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DngJpegDecoder(const DngJpegDecoder& decoder);
+    DngJpegDecoder& operator=(const DngJpegDecoder& decoder);
+};
+
+DngJpegDecoder::DngJpegDecoder(const void* data, uint32 size)
+    : m_Source(data, size),
+      m_Created(false)
+{
+    m_Info.err = jpeg_std_error(&m_Error);
+    m_Error.error_exit = DngJpegErrorMgr::jpeg_error_exit;
+
+    if (setjmp(m_Error.setjmp_buffer))
+        return;
+
+    jpeg_create_decompress(&m_Info);
+    m_Info.src = &m_Source;
+    m_Created = true;
+}
+
+DngJpegDecoder::~DngJpegDecoder(void)
+{
+    if (m_Created)
+        jpeg_destroy_decompress(&m_Info);
+}
+
+bool DngJpegDecoder::ReadHeader()
+{
+    if (!m_Created)
+        return false;
+
+    if (setjmp(m_Error.setjmp_buffer))
+        return false;
+
+    jpeg_read_header(&m_Info, true);
+    return true;
+}
+
+bool DngJpegDecoder::Start(J_COLOR_SPACE colorSpace, uint32 scaleDenom)
+{
+    if (setjmp(m_Error.setjmp_buffer))
+        return false;
+
+    m_Info.out_color_space = colorSpace;
+    m_Info.scale_num = 1;
+    m_Info.scale_denom = scaleDenom;
+
+    jpeg_start_decompress(&m_Info);
+    return true;
+}
+
+bool DngJpegDecoder::ReadRows(JSAMPROW* rows, uint32 count)
 {
-    /*
-    jpeg_error_mgr::output_message = ;
-    jpeg_error_mgr::emit_message = ;
-    jpeg_error_mgr::output_message = ;
-    */
-    this->host = h;
+    if (setjmp(m_Error.setjmp_buffer))
+        return false;
+
+    uint32 done = 0;
+    while (done < count)
+        done += jpeg_read_scanlines(&m_Info, rows + done, count - done);
+    return true;
+}
+
+bool DngJpegDecoder::Finish()
+{
+    if (setjmp(m_Error.setjmp_buffer))
+        return false;
+
+    jpeg_finish_decompress(&m_Info);
+    return true;
 }
 
-DngReadImage::DngReadImage(void)
+DngReadImage::DngReadImage(uint32 scale)
+    : m_Scale(scale),
+      m_TileData(),
+      m_StripData()
 {
 }
 
@@ -127,63 +217,184 @@ bool DngReadImage::ReadBaselineJPEG(dng_host& host,
                                     const dng_ifd& /*ifd*/,
                                     dng_stream& stream,
                                     dng_image& image,
-                                    const dng_rect& /*tileArea*/,
-                                    uint32 /*plane*/,
-                                    uint32 /*planes*/,
+                                    const dng_rect& tileArea,
+                                    uint32 plane,
+                                    uint32 planes,
                                     uint32 tileByteCount)
 {
-    uint64 startPos = stream.Position();
-    uint8 header[2];
-    header[0] = stream.Get_uint8();
-    header[1] = stream.Get_uint8();
+    if ((tileByteCount < 2) || (plane >= image.Planes()))
+    {
+        return false;
+    }
+
+    // the whole tile in one read, libjpeg never reads past its end
+    if (!m_TileData.Get() || (m_TileData->LogicalSize() < tileByteCount))
+    {
+        m_TileData.Reset();
+        m_TileData.Reset(host.Allocate(tileByteCount));
+    }
+    stream.Get(m_TileData->Buffer(), tileByteCount);
 
-    unsigned char jpegID[] = { 0xFF, 0xD8 };
-    if (memcmp(header, jpegID, 2) != 0)
+    const uint8* data = m_TileData->Buffer_uint8();
+    if ((data[0] != 0xFF) || (data[1] != 0xD8))
     {
         return false;
     }
-    stream.SetReadPosition(startPos);
 
-    DngStreamSourceMgr smgr(&stream, tileByteCount);
-    DngStreamErrorMgr jerr(&host);
+    DngJpegDecoder decoder(data, tileByteCount);
+    if (!decoder.ReadHeader() || !decoder.Start((planes == 3) ? JCS_RGB : JCS_GRAYSCALE, m_Scale))
+    {
+        return false;
+    }
+
+    const jpeg_decompress_struct& cinfo = decoder.Info();
+    if (static_cast<uint32>(cinfo.output_components) != planes)
+    {
+        return false;
+    }
+
+    // where the tile lands in the image, which may be smaller than the
+    // tile at the right and bottom edges
+    dng_rect area(tileArea.t / m_Scale, tileArea.l / m_Scale,
+                  tileArea.t / m_Scale + cinfo.output_height, tileArea.l / m_Scale + cinfo.output_width);
+    dng_rect clipped = area & image.Bounds();
+
+    uint32 rowBytes = cinfo.output_width * planes;
+    if (!m_StripData.Get() || (m_StripData->LogicalSize() < kStripRows * rowBytes))
+    {
+        m_StripData.Reset();
+        m_StripData.Reset(host.Allocate(kStripRows * rowBytes));
+    }
 
-    AutoPtr<dng_memory_block> dstData(host.Allocate(image.Width() * image.Height() * 3 * sizeof(uint8)));
-    
     dng_pixel_buffer buffer;
 
-    buffer.fArea       = dng_rect(image.Height(), image.Width());
+    buffer.fPlane      = plane;
+    buffer.fPlanes     = Min_uint32(planes, image.Planes() - plane);
+    buffer.fRowStep    = rowBytes;
+    buffer.fColStep    = planes;
+    buffer.fPlaneStep  = 1;
+    buffer.fPixelType  = ttByte;
+    buffer.fPixelSize  = TagTypeSize(ttByte);
+    buffer.fData       = m_StripData->Buffer();
+
+    JSAMPROW rows[kStripRows];
+
+    while (cinfo.output_scanline < cinfo.output_height)
+    {
+        int32 top = area.t + cinfo.output_scanline;
+        uint32 count = Min_uint32(kStripRows, cinfo.output_height - cinfo.output_scanline);
+
+        for (uint32 row = 0; row < count; row++)
+            rows[row] = (JSAMPROW)(m_StripData->Buffer_uint8() + row * rowBytes);
+
+        if (!decoder.ReadRows(rows, count))
+        {
+            return false;
+        }
+
+        buffer.fArea = dng_rect(top, area.l, top + count, area.r);
+
+        dng_rect put = buffer.fArea & clipped;
+        if (put.NotEmpty())
+        {
+            dng_pixel_buffer part(buffer);
+            part.fArea = put;
+            part.fData = buffer.DirtyPixel(put.t, put.l, plane);
+            image.Put(part);
+        }
+    }
+
+    return decoder.Finish();
+}
+
+dng_image* DngReadImage::ReadScaled(dng_host &host, const dng_ifd &ifd, dng_stream &stream, uint32 minimumSize)
+{
+    // The tiles are decoded at 1/2, 1/4 or 1/8 size by libjpeg. Tiles must
+    // divide evenly to land on whole pixels, which holds for the multiples
+    // of 16 JPEG tiles are made of.
+    uint32 scale = 1;
+    if (ifd.IsBaselineJPEG() && (minimumSize > 0))
+    {
+        uint32 longSide = Max_uint32(ifd.fImageWidth, ifd.fImageLength);
+        while ((scale < 8) && (longSide / (scale * 2) >= minimumSize) &&
+                ((ifd.TilesAcross() == 1) || (ifd.fTileWidth % (scale * 2) == 0)) &&
+                ((ifd.TilesDown() == 1) || (ifd.fTileLength % (scale * 2) == 0)))
+        {
+            scale *= 2;
+        }
+    }
+
+    dng_rect bounds((ifd.fImageLength + scale - 1) / scale, (ifd.fImageWidth + scale - 1) / scale);
+
+    AutoPtr<dng_image> image(host.Make_dng_image(bounds, ifd.fSamplesPerPixel, ifd.PixelType()));
+
+    DngReadImage reader(scale);
+    reader.Read(host, ifd, stream, *image.Get());
+
+    return image.Release();
+}
+
+dng_image* DngReadImage::DecodeJPEG(dng_host &host, const void *data, uint32 size, uint32 minimumSize)
+{
+    DngJpegDecoder decoder(data, size);
+    if (!decoder.ReadHeader())
+    {
+        return NULL;
+    }
+
+    const jpeg_decompress_struct& cinfo = decoder.Info();
+    if (cinfo.num_components != 3)
+    {
+        return NULL;
+    }
+
+    // libjpeg scales by 1/1, 1/2, 1/4 or 1/8 while doing the inverse DCT
+    uint32 longSide = Max_uint32(cinfo.image_width, cinfo.image_height);
+    uint32 scale = 1;
+    while (minimumSize > 0 && scale < 8 && longSide / (scale * 2) >= minimumSize)
+    {
+        scale *= 2;
+    }
+
+    if (!decoder.Start(JCS_RGB, scale))
+    {
+        return NULL;
+    }
+
+    uint32 width = cinfo.output_width;
+    uint32 height = cinfo.output_height;
+
+    AutoPtr<dng_memory_block> dstData(host.Allocate(width * height * 3 * sizeof(uint8)));
+
+    dng_pixel_buffer buffer;
+
+    buffer.fArea       = dng_rect(height, width);
     buffer.fPlane      = 0;
     buffer.fPlanes     = 3;
-    buffer.fRowStep    = buffer.fPlanes * image.Width();
+    buffer.fRowStep    = buffer.fPlanes * width;
     buffer.fColStep    = buffer.fPlanes;
     buffer.fPlaneStep  = 1;
     buffer.fPixelType  = ttByte;
     buffer.fPixelSize  = TagTypeSize(ttByte);
     buffer.fData       = dstData->Buffer();
 
-    struct jpeg_decompress_struct cinfo;
-    jpeg_create_decompress(&cinfo);
-
-    cinfo.src = &smgr;
-    cinfo.err = jpeg_std_error(&jerr);
-    
-    jpeg_read_header(&cinfo, true);
-
-    jpeg_start_decompress(&cinfo);
-
     JSAMPROW row_pointer;
     while (cinfo.output_scanline < cinfo.output_height)
     {
-        row_pointer = (JSAMPROW)buffer.ConstPixel_uint8(cinfo.output_scanline, 0);
-        jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+        row_pointer = (JSAMPROW)buffer.DirtyPixel_uint8(cinfo.output_scanline, 0);
+        if (!decoder.ReadRows(&row_pointer, 1))
+        {
+            return NULL;
+        }
     }
 
-    jpeg_finish_decompress(&cinfo);
-    jpeg_destroy_decompress(&cinfo);
+    if (!decoder.Finish())
+    {
+        return NULL;
+    }
 
-    image.Put(buffer);
+    AutoPtr<dng_image> image(host.Make_dng_image(buffer.fArea, 3, ttByte));
+    image->Put(buffer);
 
-    return true;
+    return image.Release();
 }
-
-
@@ -19,15 +19,35 @@
 
 #pragma once
 
+#include <dng_auto_ptr.h>
+#include <dng_memory.h>
 #include <dng_read_image.h>
 
 class DngReadImage : public dng_read_image
 {
 public:
-    DngReadImage(void);
+    // Baseline JPEG tiles are decoded at 1 / scale of their size, which
+    // may be 1, 2, 4 or 8, into an image that much smaller than the IFD.
+    DngReadImage(uint32 scale = 1);
     ~DngReadImage(void);
 
+    // Reads the IFD's image, a baseline JPEG one such as a preview or
+    // thumbnail reduced while decoding as long as the longer side stays at
+    // least minimumSize. Zero reads it at full size.
+    static dng_image* ReadScaled(dng_host &host, const dng_ifd &ifd, dng_stream &stream, uint32 minimumSize);
+
+    // Decodes a JPEG held in memory to an 8 bit RGB image. A non zero
+    // minimumSize lets libjpeg scale in the DCT domain as long as the longer
+    // side stays at least minimumSize. Returns NULL if the data can not be decoded.
+    static dng_image* DecodeJPEG(dng_host &host, const void *data, uint32 size, uint32 minimumSize = 0);
+
 protected:
     virtual bool ReadBaselineJPEG(dng_host &host, const dng_ifd &ifd, dng_stream &stream,
                                   dng_image &image, const dng_rect &tileArea, uint32 plane, uint32 planes, uint32 tileByteCount);
+
+private:
+    uint32 m_Scale;
+    // Compressed tile and decoded rows, reused across the tiles of an IFD
+    AutoPtr<dng_memory_block> m_TileData;
+    AutoPtr<dng_memory_block> m_StripData;
 };
@@ -0,0 +1,228 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#include "dngthreadpool.h"
+
+#include "dng_exceptions.h"
+#include "dng_utils.h"
+
+#if qWinOS
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+DngThreadPool::DngThreadPool(uint32 threads, uint32 maxQueued)
+    : m_Threads(0),
+#if qDNGThreadSafe
+      m_ThreadIds(NULL),
+      m_Mutex("DngThreadPool"),
+      m_JobAvailable(),
+      m_JobsDone(),
+      m_QueueSpace(),
+#endif
+      m_Queue(),
+      m_MaxQueued(maxQueued),
+      m_Pending(0),
+      m_Shutdown(false),
+      m_Error(dng_error_none)
+{
+#if qDNGThreadSafe
+    if (threads == 0)
+        return;
+
+    m_ThreadIds = new pthread_t[threads];
+    if (!m_ThreadIds)
+    {
+        ThrowMemoryFull();
+    }
+
+    for (uint32 i = 0; i < threads; i++)
+    {
+        if (pthread_create(&m_ThreadIds[i], NULL, DngThreadPool::ThreadFunc, (void*)this) != 0)
+            break;
+        m_Threads++;
+    }
+#else
+    (void)threads;
+#endif
+}
+
+DngThreadPool::~DngThreadPool(void)
+{
+#if qDNGThreadSafe
+    {
+        dng_lock_mutex lock(&m_Mutex);
+        m_Shutdown = true;
+        m_JobAvailable.Broadcast();
+    }
+
+    for (uint32 i = 0; i < m_Threads; i++)
+    {
+        pthread_join(m_ThreadIds[i], NULL);
+    }
+
+    delete [] m_ThreadIds;
+#endif
+}
+
+uint32 DngThreadPool::Threads() const
+{
+    return m_Threads;
+}
+
+void DngThreadPool::Submit(Job *job)
+{
+    if (m_Threads == 0)
+    {
+        // No worker threads available, run the job on the calling thread
+        try
+        {
+            job->Run();
+        }
+        catch (const dng_exception &except)
+        {
+            if (m_Error == dng_error_none)
+                m_Error = except.ErrorCode();
+        }
+        catch (...)
+        {
+            if (m_Error == dng_error_none)
+                m_Error = dng_error_unknown;
+        }
+        return;
+    }
+
+#if qDNGThreadSafe
+    dng_lock_mutex lock(&m_Mutex);
+    while ((m_MaxQueued != 0) && (m_Queue.size() >= m_MaxQueued))
+    {
+        m_QueueSpace.Wait(m_Mutex);
+    }
+    m_Queue.push_back(job);
+    m_Pending++;
+    m_JobAvailable.Signal();
+#endif
+}
+
+bool DngThreadPool::Withdraw(Job *job)
+{
+#if qDNGThreadSafe
+    dng_lock_mutex lock(&m_Mutex);
+    for (std::deque<Job*>::iterator it = m_Queue.begin(); it != m_Queue.end(); ++it)
+    {
+        if (*it == job)
+        {
+            m_Queue.erase(it);
+            m_QueueSpace.Signal();
+            if (--m_Pending == 0)
+                m_JobsDone.Broadcast();
+            return true;
+        }
+    }
+#else
+    (void)job;
+#endif
+    return false;
+}
+
+void DngThreadPool::Wait()
+{
+    dng_error_code error;
+
+    {
+#if qDNGThreadSafe
+        dng_lock_mutex lock(&m_Mutex);
+        while (m_Pending > 0)
+        {
+            m_JobsDone.Wait(m_Mutex);
+        }
+#endif
+        error = m_Error;
+        m_Error = dng_error_none;
+    }
+
+    if (error != dng_error_none)
+    {
+        Throw_dng_error(error);
+    }
+}
+
+void* DngThreadPool::ThreadFunc(void *data)
+{
+    ((DngThreadPool *)data)->WorkerLoop();
+    return NULL;
+}
+
+void DngThreadPool::WorkerLoop()
+{
+#if qDNGThreadSafe
+    while (true)
+    {
+        Job *job = NULL;
+
+        {
+            dng_lock_mutex lock(&m_Mutex);
+            while (m_Queue.empty() && !m_Shutdown)
+            {
+                m_JobAvailable.Wait(m_Mutex);
+            }
+            if (m_Queue.empty())
+                break;
+            job = m_Queue.front();
+            m_Queue.pop_front();
+            m_QueueSpace.Signal();
+        }
+
+        dng_error_code error = dng_error_none;
+        try
+        {
+            job->Run();
+        }
+        catch (const dng_exception &except)
+        {
+            error = except.ErrorCode();
+        }
+        catch (...)
+        {
+            error = dng_error_unknown;
+        }
+
+        {
+            dng_lock_mutex lock(&m_Mutex);
+            if ((error != dng_error_none) && (m_Error == dng_error_none))
+                m_Error = error;
+            if (--m_Pending == 0)
+                m_JobsDone.Broadcast();
+        }
+    }
+#endif
+}
+
+uint32 DngThreadPool::ProcessorCount()
+{
+#if qWinOS
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return Max_uint32(1, info.dwNumberOfProcessors);
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? static_cast<uint32>(count) : 1;
+#endif
+}
@@ -0,0 +1,85 @@
+/* This file is part of the dngconvert project
+   Copyright (C) 2011 Jens Mueller <tschensensinger at gmx dot de>
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Library General Public
+   License as published by the Free Software Foundation; either
+   version 2 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Library General Public License for more details.
+
+   You should have received a copy of the GNU Library General Public License
+   along with this library; see the file COPYING.  If not, write to
+   the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+   Boston, MA 02110-1301, USA.
+*/
+
+#pragma once
+
+#include <deque>
+
+#include "dng_classes.h"
+#include "dng_errors.h"
+#include "dng_mutex.h"
+#include "dng_types.h"
+
+// DngThreadPool keeps a fixed set of worker threads alive and runs
+// submitted jobs on them. Jobs are owned by the caller and must stay
+// alive until Wait() returns. A non zero maxQueued bounds the number of
+// jobs waiting for a thread, Submit() then blocks until one is picked up.
+
+class DngThreadPool
+{
+public:
+    class Job
+    {
+    public:
+        virtual ~Job(void) {}
+        virtual void Run() = 0;
+    };
+
+public:
+    DngThreadPool(uint32 threads, uint32 maxQueued = 0);
+    ~DngThreadPool(void);
+
+    uint32 Threads() const;
+
+    void Submit(Job *job);
+
+    // Takes a job back out of the queue if no thread has picked it up yet,
+    // it is then not run. Returns false if the job is running or done.
+    bool Withdraw(Job *job);
+
+    // Blocks until every submitted job has finished. The first dng_exception
+    // thrown by a job is rethrown here.
+    void Wait();
+
+    static uint32 ProcessorCount();
+
+private:
+    static void* ThreadFunc(void *data);
+    void WorkerLoop();
+
+private:
+    uint32 m_Threads;
+#if qDNGThreadSafe
+    pthread_t *m_ThreadIds;
+    dng_mutex m_Mutex;
+    dng_condition m_JobAvailable;
+    dng_condition m_JobsDone;
+    dng_condition m_QueueSpace;
+#endif
+    std::deque<Job*> m_Queue;
+    uint32 m_MaxQueued;
+    uint32 m_Pending;
+    bool m_Shutdown;
+    dng_error_code m_Error;
+
+private:
+    // Hidden copy constructor and assignment operator.
+    DngThreadPool(const DngThreadPool &pool);
+    DngThreadPool& operator=(const DngThreadPool &pool);
+};